@@ -0,0 +1,616 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "audio-click.h"
+#include "latency-stats.h"
+
+#include <alsa/asoundlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#define SAMPLE_RATE 48000
+#define PERIOD_FRAMES 64  // 1.3 ms at 48 kHz
+#define N_PERIODS 3
+#define CLICK_LENGTH 20  // ms of each click sample
+#define CLICK_DECAY 300.0  // Per second
+#define CLICK_AMPLITUDE 0.8
+#define EVENT_RING_SIZE 1024  // Power of two
+#define MAX_VOICES 64  // Clicks sounding or waiting to sound
+#define AUDIO_THREAD_PRIORITY 20  // Above the drum I/O thread
+#define WAIT_TIMEOUT 100  // ms
+#define CLOCK_SMOOTHING 0.01  // Part of a clock measurement taken in
+
+typedef enum ClickSample_ ClickSample;
+
+enum ClickSample_ { SAMPLE_ACCENT, SAMPLE_NORMAL, SAMPLE_LAYER, N_SAMPLES };
+
+static const double SAMPLE_PITCHES[N_SAMPLES] = {
+    [SAMPLE_ACCENT] = 1760,
+    [SAMPLE_NORMAL] = 1320,
+    [SAMPLE_LAYER] = 880 };
+
+/*
+ * A click to play, or a cancel of the clicks waiting at or after time.
+ */
+typedef struct AudioEvent_ AudioEvent;
+
+struct AudioEvent_
+{
+    gint64 time;  // Queue us
+    float gain;
+    ClickSample sample;
+    gboolean cancel;
+};
+
+typedef struct Voice_ Voice;
+
+struct Voice_
+{
+    gint64 time;  // Queue us
+    float gain;
+    ClickSample sample;
+    gboolean started;
+    guint position;  // Next frame of the sample once started
+};
+
+static snd_pcm_t *pcm = NULL;
+static gboolean use_mmap = FALSE;
+static unsigned int rate = SAMPLE_RATE;
+static unsigned int n_channels = 2;
+static snd_pcm_uframes_t period_frames = PERIOD_FRAMES;
+static snd_pcm_uframes_t buffer_frames = PERIOD_FRAMES * N_PERIODS;
+
+static float *samples[N_SAMPLES];
+static guint sample_length = 0;
+static float *mix_buffer = NULL;  // One period
+static gint16 *period_buffer = NULL;  // One period, without mmap access
+
+// Single producer, single consumer ring of events, drum I/O -> audio thread
+static AudioEvent events[EVENT_RING_SIZE];
+static volatile gint events_head = 0;
+static volatile gint events_tail = 0;
+
+static GThread *audio_thread = NULL;
+static volatile gint thread_quit = FALSE;
+static gint64 start_time = 0;  // Monotonic us at queue time 0
+
+static volatile gint n_clicks_played = 0;
+static volatile gint n_late_clicks = 0;
+static volatile gint n_xruns = 0;
+
+// Only used by the audio thread
+static Voice voices[MAX_VOICES];
+static guint n_voices = 0;
+static guint64 frames_written = 0;
+static gdouble frame_zero_time = 0;  // Monotonic us that frame 0 plays at
+static gboolean clock_valid = FALSE;
+
+GQuark
+audio_click_error_quark (void)
+{
+    return g_quark_from_static_string ("audio-click-error-quark");
+}
+
+static gboolean
+device_error (GError **error, const char *device, int err)
+{
+    g_set_error (error, AUDIO_CLICK_ERROR, AUDIO_CLICK_ERROR_DEVICE,
+            "%s: %s", device, snd_strerror (err));
+
+    if (pcm != NULL)
+    {
+        snd_pcm_close (pcm);
+        pcm = NULL;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Renders a decaying sine burst for each click sample.
+ */
+static void
+render_samples (void)
+{
+    sample_length = rate * CLICK_LENGTH / 1000;
+
+    for (int s = 0; s < N_SAMPLES; ++s)
+    {
+        samples[s] = g_renew (float, samples[s], sample_length);
+        for (guint i = 0; i < sample_length; ++i)
+        {
+            double t = (double) i / rate;
+            samples[s][i] = CLICK_AMPLITUDE * exp (-t * CLICK_DECAY) *
+                sin (2 * G_PI * SAMPLE_PITCHES[s] * t);
+        }
+    }
+}
+
+/**
+ * Opens the PCM device to play clicks on. Memory mapped access is used if
+ * the device has it. Returns FALSE and sets error if the device could not be
+ * opened or configured.
+ */
+gboolean
+audio_click_open (const char *device, GError **error)
+{
+    g_assert (pcm == NULL);
+
+    int err = snd_pcm_open (&pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0)
+    {
+        pcm = NULL;
+        return device_error (error, device, err);
+    }
+
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_hw_params_alloca (&hw_params);
+    snd_pcm_hw_params_any (pcm, hw_params);
+
+    use_mmap = snd_pcm_hw_params_set_access (pcm, hw_params,
+            SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+    if (!use_mmap)
+    {
+        err = snd_pcm_hw_params_set_access (pcm, hw_params,
+                SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (err < 0)
+        {
+            return device_error (error, device, err);
+        }
+    }
+
+    rate = SAMPLE_RATE;
+    n_channels = 2;
+    period_frames = PERIOD_FRAMES;
+    buffer_frames = PERIOD_FRAMES * N_PERIODS;
+
+    if ((err = snd_pcm_hw_params_set_format (pcm, hw_params,
+                    SND_PCM_FORMAT_S16)) < 0 ||
+            (err = snd_pcm_hw_params_set_channels_near (pcm, hw_params,
+                    &n_channels)) < 0 ||
+            (err = snd_pcm_hw_params_set_rate_near (pcm, hw_params,
+                    &rate, NULL)) < 0 ||
+            (err = snd_pcm_hw_params_set_period_size_near (pcm, hw_params,
+                    &period_frames, NULL)) < 0 ||
+            (err = snd_pcm_hw_params_set_buffer_size_near (pcm, hw_params,
+                    &buffer_frames)) < 0 ||
+            (err = snd_pcm_hw_params (pcm, hw_params)) < 0)
+    {
+        return device_error (error, device, err);
+    }
+
+    // Start playing once the buffer is filled, wake up every period
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_sw_params_alloca (&sw_params);
+    snd_pcm_sw_params_current (pcm, sw_params);
+
+    if ((err = snd_pcm_sw_params_set_start_threshold (pcm, sw_params,
+                    buffer_frames)) < 0 ||
+            (err = snd_pcm_sw_params_set_avail_min (pcm, sw_params,
+                    period_frames)) < 0 ||
+            (err = snd_pcm_sw_params (pcm, sw_params)) < 0)
+    {
+        return device_error (error, device, err);
+    }
+
+    render_samples ();
+    mix_buffer = g_renew (float, mix_buffer, period_frames);
+    period_buffer = g_renew (gint16, period_buffer,
+            period_frames * n_channels);
+
+    return TRUE;
+}
+
+/**
+ * Closes the PCM device. Audio clicks must not be playing.
+ */
+void
+audio_click_close (void)
+{
+    g_assert (audio_thread == NULL);
+
+    if (pcm != NULL)
+    {
+        snd_pcm_close (pcm);
+        pcm = NULL;
+    }
+}
+
+/*
+ * Takes the events from the ring, clicks wait as voices until their frame.
+ */
+static void
+take_events (void)
+{
+    guint tail = events_tail;
+    guint head = g_atomic_int_get (&events_head);
+
+    for (; tail != head; ++tail)
+    {
+        const AudioEvent *event = &events[tail & (EVENT_RING_SIZE - 1)];
+
+        if (event->cancel)
+        {
+            for (guint i = 0; i < n_voices;)
+            {
+                if (!voices[i].started && voices[i].time >= event->time)
+                {
+                    voices[i] = voices[--n_voices];
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+        }
+        else if (n_voices < MAX_VOICES)
+        {
+            Voice voice = { time: event->time, gain: event->gain,
+                sample: event->sample, started: FALSE, position: 0 };
+            voices[n_voices++] = voice;
+        }
+        else
+        {
+            g_atomic_int_inc (&n_late_clicks);
+        }
+    }
+
+    g_atomic_int_set (&events_tail, tail);
+}
+
+/*
+ * Measures when frame 0 plays from the delay of the PCM. Measurements are
+ * smoothed, which also follows any drift of the sound card clock.
+ */
+static void
+update_clock (void)
+{
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay (pcm, &delay) < 0)
+    {
+        return;
+    }
+    gint64 now = latency_stats_now ();
+
+    // The next frame written plays after the frames in the buffer
+    gdouble zero_time = now + (delay - (gdouble) frames_written) *
+        G_USEC_PER_SEC / rate;
+
+    if (!clock_valid)
+    {
+        frame_zero_time = zero_time;
+        clock_valid = TRUE;
+    }
+    else
+    {
+        frame_zero_time += (zero_time - frame_zero_time) * CLOCK_SMOOTHING;
+    }
+}
+
+/*
+ * Mixes the voices sounding in the next n_frames frames into out.
+ */
+static void
+mix_period (gint16 *out, snd_pcm_uframes_t n_frames)
+{
+    memset (mix_buffer, 0, sizeof (float) * n_frames);
+
+    for (guint i = 0; i < n_voices;)
+    {
+        Voice *voice = &voices[i];
+        snd_pcm_uframes_t frame = 0;
+
+        if (!voice->started)
+        {
+            gint64 start_frame = floor ((start_time + voice->time -
+                        frame_zero_time) * rate / G_USEC_PER_SEC + 0.5);
+            gint64 offset = start_frame - (gint64) frames_written;
+            if (offset >= (gint64) n_frames)
+            {
+                ++i;
+                continue;
+            }
+
+            if (offset < 0)
+            {
+                g_atomic_int_inc (&n_late_clicks);
+                offset = 0;
+            }
+
+            frame = offset;
+            voice->started = TRUE;
+            g_atomic_int_inc (&n_clicks_played);
+        }
+
+        const float *sample = samples[voice->sample];
+        for (; frame < n_frames && voice->position < sample_length; ++frame)
+        {
+            mix_buffer[frame] += voice->gain * sample[voice->position++];
+        }
+
+        if (voice->position >= sample_length)
+        {
+            voices[i] = voices[--n_voices];
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    for (snd_pcm_uframes_t frame = 0; frame < n_frames; ++frame)
+    {
+        gint16 value = CLAMP (mix_buffer[frame], -1.0f, 1.0f) * G_MAXINT16;
+        for (unsigned int channel = 0; channel < n_channels; ++channel)
+        {
+            out[frame * n_channels + channel] = value;
+        }
+    }
+}
+
+/*
+ * Writes up to one period, less at the end of the mmap buffer. Returns the
+ * number of frames written or a negative error code on failure.
+ */
+static snd_pcm_sframes_t
+write_period (void)
+{
+    if (!use_mmap)
+    {
+        mix_period (period_buffer, period_frames);
+        snd_pcm_sframes_t n_written = snd_pcm_writei (pcm, period_buffer,
+                period_frames);
+        if (n_written > 0)
+        {
+            frames_written += n_written;
+        }
+
+        return n_written;
+    }
+
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t n_frames = period_frames;
+    int err = snd_pcm_mmap_begin (pcm, &areas, &offset, &n_frames);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    // Interleaved, the first area has all channels
+    gint16 *out = (gint16 *) ((char *) areas[0].addr +
+            (areas[0].first + offset * areas[0].step) / 8);
+    mix_period (out, n_frames);
+
+    snd_pcm_sframes_t n_committed = snd_pcm_mmap_commit (pcm, offset,
+            n_frames);
+    if (n_committed < 0)
+    {
+        return n_committed;
+    }
+    frames_written += n_committed;
+
+    return n_committed;
+}
+
+/*
+ * Recovers from err, counting underruns. The clock is measured again after
+ * the PCM restarted.
+ */
+static void
+recover (int err)
+{
+    if (err == -EPIPE)
+    {
+        g_atomic_int_inc (&n_xruns);
+    }
+
+    if (snd_pcm_recover (pcm, err, 1) < 0)
+    {
+        snd_pcm_prepare (pcm);
+    }
+    clock_valid = FALSE;
+}
+
+static void
+set_realtime_priority (void)
+{
+    struct sched_param param;
+    param.sched_priority = sched_get_priority_min (SCHED_FIFO) +
+        AUDIO_THREAD_PRIORITY;
+
+    int err = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+    if (err != 0)
+    {
+        g_message ("Running audio click thread without realtime "
+                "priority: %s", g_strerror (err));
+    }
+}
+
+/*
+ * Keeps the PCM buffer filled, one period at a time.
+ */
+static gpointer
+audio_thread_func (gpointer data)
+{
+    set_realtime_priority ();
+
+    while (!g_atomic_int_get (&thread_quit))
+    {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update (pcm);
+        if (avail < 0)
+        {
+            recover (avail);
+            continue;
+        }
+
+        if ((snd_pcm_uframes_t) avail < period_frames)
+        {
+            int err = snd_pcm_wait (pcm, WAIT_TIMEOUT);
+            if (err < 0)
+            {
+                recover (err);
+            }
+            continue;
+        }
+
+        if (snd_pcm_state (pcm) == SND_PCM_STATE_RUNNING)
+        {
+            update_clock ();
+        }
+        take_events ();
+
+        while ((snd_pcm_uframes_t) avail >= period_frames)
+        {
+            snd_pcm_sframes_t n_written = write_period ();
+            if (n_written < 0)
+            {
+                recover (n_written);
+                break;
+            }
+            if (n_written == 0)
+            {
+                break;
+            }
+            avail -= n_written;
+        }
+
+        // Before the PCM has started the clock is measured as the buffer
+        // fills, so the first clicks are placed as well as they can be
+        if (!clock_valid)
+        {
+            update_clock ();
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts playing clicks. Start_time is the monotonic time in us at which the
+ * queue was at time 0.
+ */
+void
+audio_click_start (gint64 new_start_time)
+{
+    g_assert (pcm != NULL);
+    g_assert (audio_thread == NULL);
+
+    start_time = new_start_time;
+    events_head = 0;
+    events_tail = 0;
+    n_voices = 0;
+    frames_written = 0;
+    clock_valid = FALSE;
+    thread_quit = FALSE;
+
+    snd_pcm_drop (pcm);
+    snd_pcm_prepare (pcm);
+
+    GError *error = NULL;
+    audio_thread = g_thread_create (audio_thread_func, NULL, TRUE, &error);
+    if (audio_thread == NULL)
+    {
+        g_warning ("Could not create audio click thread: %s",
+                error->message);
+        g_error_free (error);
+    }
+}
+
+/**
+ * Stops playing clicks, dropping the clicks that are waiting.
+ */
+void
+audio_click_stop (void)
+{
+    if (audio_thread != NULL)
+    {
+        g_atomic_int_set (&thread_quit, TRUE);
+        g_thread_join (audio_thread);
+        audio_thread = NULL;
+    }
+
+    snd_pcm_drop (pcm);
+}
+
+static gboolean
+push_event (const AudioEvent *event)
+{
+    guint head = events_head;
+    guint tail = g_atomic_int_get (&events_tail);
+
+    if (head - tail >= EVENT_RING_SIZE)
+    {
+        return FALSE;
+    }
+
+    events[head & (EVENT_RING_SIZE - 1)] = *event;
+
+    // Publish the event, the atomic set acts as a barrier for the copy above
+    g_atomic_int_set (&events_head, head + 1);
+
+    return TRUE;
+}
+
+/**
+ * Plays a click at time, in us of the queue. Accented clicks and clicks of
+ * other layers than the first have their own sounds. Returns FALSE if too
+ * many clicks are waiting. Must only be called by one thread.
+ */
+gboolean
+audio_click_push (gint64 time, int velocity, gboolean accented,
+        gboolean layer)
+{
+    AudioEvent event = { time: time, gain: velocity / 127.0f,
+        sample: layer ? SAMPLE_LAYER :
+            accented ? SAMPLE_ACCENT : SAMPLE_NORMAL,
+        cancel: FALSE };
+
+    return push_event (&event);
+}
+
+/**
+ * Drops the clicks pushed so far that have not started by time. Must only
+ * be called by the thread that pushes clicks.
+ */
+void
+audio_click_cancel (gint64 time)
+{
+    AudioEvent event = { time: time, gain: 0, sample: SAMPLE_NORMAL,
+        cancel: TRUE };
+
+    // The audio thread empties the ring every period
+    while (!push_event (&event))
+    {
+        g_usleep (1000);
+    }
+}
+
+/**
+ * Gets the audio click statistics. May be called while playing.
+ */
+void
+audio_click_get_stats (AudioClickStats *stats)
+{
+    stats->clicks_played = g_atomic_int_get (&n_clicks_played);
+    stats->late_clicks = g_atomic_int_get (&n_late_clicks);
+    stats->xruns = g_atomic_int_get (&n_xruns);
+}
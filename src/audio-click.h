@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AUDIO_CLICK_H__
+#define __AUDIO_CLICK_H__
+
+#include <glib.h>
+
+/*
+ * Plays clicks as audio through an ALSA PCM device instead of through a MIDI
+ * sound module. Clicks are mixed from pre-rendered samples by a realtime
+ * thread, each starting at the frame that plays at its time, so the click
+ * latency is bounded by the PCM period. Times are in us of the sequencer
+ * queue, which runs on the monotonic clock from the time given to
+ * audio_click_start().
+ */
+
+#define AUDIO_CLICK_ERROR audio_click_error_quark ()
+
+typedef enum AudioClickError_ AudioClickError;
+
+enum AudioClickError_ { AUDIO_CLICK_ERROR_DEVICE };
+
+typedef struct AudioClickStats_ AudioClickStats;
+
+struct AudioClickStats_
+{
+    guint clicks_played;
+    guint late_clicks;  // Clicks that arrived after their frame was written
+    guint xruns;  // Buffer underruns of the PCM
+};
+
+GQuark audio_click_error_quark (void);
+
+gboolean audio_click_open (const char *device, GError **error);
+void audio_click_close (void);
+
+void audio_click_start (gint64 start_time);
+void audio_click_stop (void);
+
+gboolean audio_click_push (gint64 time, int velocity, gboolean accented,
+        gboolean layer);
+void audio_click_cancel (gint64 time);
+
+void audio_click_get_stats (AudioClickStats *stats);
+
+#endif // __AUDIO_CLICK_H__
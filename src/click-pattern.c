@@ -0,0 +1,476 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "click-pattern.h"
+
+#include <string.h>
+
+#define MAX_NUMBER 999
+
+typedef struct Parser_ Parser;
+
+struct Parser_
+{
+    const char *text;
+    const char *pos;
+    int n_beats;  // Meter set by the pattern, 0 if none yet
+    int beat_unit;
+    unsigned int ppq;
+    GString *canonical;
+    ClickTrackBuilder *builder;  // NULL when only checking the pattern
+    GError **error;
+};
+
+// Ticks per beat and pattern text, as given and canonical, to compiled click
+// track, see get_cache_key()
+static GHashTable *cache = NULL;
+
+GQuark
+click_pattern_error_quark (void)
+{
+    return g_quark_from_static_string ("click-pattern-error-quark");
+}
+
+static void
+skip_space (Parser *parser)
+{
+    while (g_ascii_isspace (*parser->pos))
+    {
+        parser->pos++;
+    }
+}
+
+static gboolean
+parse_error (Parser *parser, ClickPatternError code, const char *message)
+{
+    g_set_error (parser->error, CLICK_PATTERN_ERROR, code,
+            "%s at position %d", message,
+            (int) (parser->pos - parser->text) + 1);
+
+    return FALSE;
+}
+
+static gboolean
+parse_number (Parser *parser, int *number)
+{
+    if (!g_ascii_isdigit (*parser->pos))
+    {
+        return parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                "Expected a number");
+    }
+
+    *number = 0;
+    while (g_ascii_isdigit (*parser->pos))
+    {
+        *number = *number * 10 + (*parser->pos - '0');
+        if (*number > MAX_NUMBER)
+        {
+            return parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                    "Number too large");
+        }
+        parser->pos++;
+    }
+
+    return TRUE;
+}
+
+static inline gboolean
+is_click (char c)
+{
+    return c == 'X' || c == 'x' || c == 'o' || c == '.';
+}
+
+static ClickType
+get_click_type (char c)
+{
+    switch (c)
+    {
+        case 'X':
+            return CLICK_ACCENTED;
+        case 'x':
+            return CLICK_NORMAL;
+        case 'o':
+            return CLICK_WEAK;
+    }
+
+    return CLICK_SILENT;
+}
+
+/*
+ * Adds a group of n_clicks clicks, starting at clicks, spread evenly over
+ * span beats from beat.
+ */
+static gboolean
+add_group (Parser *parser, const char *clicks, int n_clicks, char close,
+        int span, int beat, unsigned int beat_length)
+{
+    unsigned int start_tick = beat * beat_length;
+    unsigned int length = span * beat_length;
+
+    if (length < (unsigned int) n_clicks)
+    {
+        return parse_error (parser, CLICK_PATTERN_ERROR_METER,
+                "Too many clicks in group");
+    }
+
+    g_string_append_c (parser->canonical, ' ');
+    if (close == ')')
+    {
+        g_string_append_printf (parser->canonical, "%d(", span);
+    }
+    else if (close == ']')
+    {
+        g_string_append_c (parser->canonical, '[');
+    }
+
+    for (int i = 0; i < n_clicks; ++i)
+    {
+        while (!is_click (*clicks))
+        {
+            clicks++;
+        }
+
+        if (i > 0)
+        {
+            g_string_append_c (parser->canonical, ' ');
+        }
+        g_string_append_c (parser->canonical, *clicks);
+
+        if (parser->builder != NULL)
+        {
+            ClickBarType bar_type = BAR_SUB;
+            if (i == 0)
+            {
+                bar_type = beat == 0 ? BAR_MEASURE_START : BAR_NORMAL;
+            }
+
+            click_track_builder_add_click (parser->builder,
+                    start_tick + i * length / n_clicks,
+                    get_click_type (*clicks), bar_type);
+        }
+
+        clicks++;
+    }
+
+    if (close != '\0')
+    {
+        g_string_append_c (parser->canonical, close);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Parses the beats of a measure, up to '|' or the end of the pattern.
+ * Returns the number of beats or -1 on error. If add is TRUE the clicks are
+ * added, otherwise the beats are only counted.
+ */
+static int
+parse_beats (Parser *parser, gboolean add, unsigned int beat_length)
+{
+    int n_beats = 0;
+
+    skip_space (parser);
+    while (*parser->pos != '\0' && *parser->pos != '|')
+    {
+        int span = 1;
+        char close = '\0';
+
+        if (g_ascii_isdigit (*parser->pos))
+        {
+            if (!parse_number (parser, &span))
+            {
+                return -1;
+            }
+            if (span == 0 || *parser->pos != '(')
+            {
+                parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                        "Expected beats followed by '('");
+                return -1;
+            }
+            close = ')';
+            parser->pos++;
+        }
+        else if (*parser->pos == '[')
+        {
+            close = ']';
+            parser->pos++;
+        }
+        else if (!is_click (*parser->pos))
+        {
+            parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                    "Unexpected character");
+            return -1;
+        }
+
+        const char *clicks = parser->pos;
+        int n_clicks = 1;
+        if (close == '\0')
+        {
+            parser->pos++;
+        }
+        else
+        {
+            n_clicks = 0;
+            skip_space (parser);
+            while (is_click (*parser->pos))
+            {
+                n_clicks++;
+                parser->pos++;
+                skip_space (parser);
+            }
+
+            if (*parser->pos != close || n_clicks == 0)
+            {
+                parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                        "Expected clicks followed by ']' or ')'");
+                return -1;
+            }
+            parser->pos++;
+        }
+
+        if (add && !add_group (parser, clicks, n_clicks, close, span,
+                    n_beats, beat_length))
+        {
+            return -1;
+        }
+
+        n_beats += span;
+        if (n_beats > MAX_NUMBER)
+        {
+            parse_error (parser, CLICK_PATTERN_ERROR_METER,
+                    "Too many beats");
+            return -1;
+        }
+
+        skip_space (parser);
+    }
+
+    return n_beats;
+}
+
+static gboolean
+parse_measure (Parser *parser)
+{
+    skip_space (parser);
+
+    // Optional meter, told apart from N(...) by the '/'
+    const char *start = parser->pos;
+    if (g_ascii_isdigit (*parser->pos))
+    {
+        int n_beats;
+        int beat_unit;
+
+        if (!parse_number (parser, &n_beats))
+        {
+            return FALSE;
+        }
+        if (*parser->pos == '/')
+        {
+            parser->pos++;
+            if (!parse_number (parser, &beat_unit))
+            {
+                return FALSE;
+            }
+            skip_space (parser);
+            if (*parser->pos != ':')
+            {
+                return parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                        "Expected ':' after meter");
+            }
+            // Beats must be a whole number of ticks
+            if (n_beats == 0 || beat_unit == 0 ||
+                    (parser->ppq * 4) % beat_unit != 0)
+            {
+                return parse_error (parser, CLICK_PATTERN_ERROR_METER,
+                        "Unsupported meter");
+            }
+            parser->pos++;
+
+            parser->n_beats = n_beats;
+            parser->beat_unit = beat_unit;
+        }
+        else
+        {
+            parser->pos = start;
+        }
+    }
+
+    const char *beats = parser->pos;
+    int n_beats = parse_beats (parser, FALSE, 0);
+    if (n_beats < 0)
+    {
+        return FALSE;
+    }
+    if (n_beats == 0)
+    {
+        return parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                "Empty measure");
+    }
+    if (parser->n_beats != 0 && n_beats != parser->n_beats)
+    {
+        parser->pos = beats;
+        return parse_error (parser, CLICK_PATTERN_ERROR_METER,
+                "Beats do not match the meter of measure");
+    }
+
+    unsigned int beat_length = parser->ppq * 4 / parser->beat_unit;
+
+    if (parser->canonical->len > 0)
+    {
+        g_string_append (parser->canonical, " | ");
+    }
+    g_string_append_printf (parser->canonical, "%d/%d:", n_beats,
+            parser->beat_unit);
+
+    if (parser->builder != NULL)
+    {
+        click_track_builder_begin_measure (parser->builder,
+                n_beats * beat_length);
+    }
+
+    parser->pos = beats;
+    return parse_beats (parser, TRUE, beat_length) >= 0;
+}
+
+/*
+ * Returns the newly allocated cache key of pattern compiled with ppq ticks
+ * per beat.
+ */
+static char *
+get_cache_key (const char *pattern, unsigned int ppq)
+{
+    return g_strdup_printf ("%u %s", ppq, pattern);
+}
+
+static gboolean
+parse_pattern (Parser *parser)
+{
+    skip_space (parser);
+    if (*parser->pos == '\0')
+    {
+        return parse_error (parser, CLICK_PATTERN_ERROR_SYNTAX,
+                "Empty pattern");
+    }
+
+    for (;;)
+    {
+        if (!parse_measure (parser))
+        {
+            return FALSE;
+        }
+
+        if (*parser->pos == '\0')
+        {
+            return TRUE;
+        }
+
+        // Skip the '|', a trailing one is allowed
+        parser->pos++;
+        skip_space (parser);
+        if (*parser->pos == '\0')
+        {
+            return TRUE;
+        }
+    }
+}
+
+/**
+ * Compiles pattern into a click track with ppq ticks per quarter note.
+ * Compiled click tracks are cached, so compiling the same pattern again, or
+ * any pattern with the same meaning, returns the same click track without
+ * compiling it. The click track must not be changed. Returns a new
+ * reference, or NULL and sets error if the pattern is invalid.
+ */
+ClickTrack *
+click_pattern_compile (const char *pattern, unsigned int ppq, GError **error)
+{
+    if (cache == NULL)
+    {
+        cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                (GDestroyNotify) click_track_unref);
+    }
+
+    char *key = get_cache_key (pattern, ppq);
+    ClickTrack *click_track = g_hash_table_lookup (cache, key);
+    if (click_track != NULL)
+    {
+        g_free (key);
+        return click_track_ref (click_track);
+    }
+
+    Parser parser = { text: pattern, pos: pattern, n_beats: 0, beat_unit: 4,
+        ppq: ppq, canonical: g_string_new (NULL), builder: NULL,
+        error: error };
+
+    if (!parse_pattern (&parser))
+    {
+        g_string_free (parser.canonical, TRUE);
+        g_free (key);
+        return NULL;
+    }
+
+    char *canonical_key = get_cache_key (parser.canonical->str, ppq);
+    click_track = g_hash_table_lookup (cache, canonical_key);
+    if (click_track == NULL)
+    {
+        // Compile the canonical pattern, it has already been checked
+        Parser compiler = { text: parser.canonical->str,
+            pos: parser.canonical->str, n_beats: 0, beat_unit: 4, ppq: ppq,
+            canonical: g_string_new (NULL),
+            builder: click_track_builder_new (ppq), error: NULL };
+
+        if (!parse_pattern (&compiler))
+        {
+            g_assert_not_reached ();
+        }
+        g_string_free (compiler.canonical, TRUE);
+
+        click_track = click_track_builder_finish (compiler.builder);
+        g_hash_table_insert (cache, canonical_key, click_track);
+    }
+    else
+    {
+        g_free (canonical_key);
+    }
+
+    if (strcmp (pattern, parser.canonical->str) != 0)
+    {
+        g_hash_table_insert (cache, key, click_track_ref (click_track));
+    }
+    else
+    {
+        g_free (key);
+    }
+    g_string_free (parser.canonical, TRUE);
+
+    return click_track_ref (click_track);
+}
+
+/**
+ * Drops the compiled click tracks that are not used elsewhere.
+ */
+void
+click_pattern_clear_cache (void)
+{
+    if (cache != NULL)
+    {
+        g_hash_table_remove_all (cache);
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLICK_PATTERN_H__
+#define __CLICK_PATTERN_H__
+
+#include "click-track.h"
+#include <glib.h>
+
+/*
+ * Text notation for click programs. Measures are separated by '|' and may
+ * start with a meter, which then holds for the following measures:
+ *
+ *   4/4: X x x x | 7/8: X x x X x X x | [X x x] x 2(x x x)
+ *
+ * X is an accented click, x a normal click, o a ghost click and . a rest.
+ * Each click takes one beat, [x x x] splits one beat into the clicks inside
+ * it and N(x x x) spreads the clicks inside it evenly over N beats. Without
+ * any meter the beats of each measure are quarter notes.
+ */
+
+#define CLICK_PATTERN_ERROR click_pattern_error_quark ()
+
+typedef enum ClickPatternError_ ClickPatternError;
+
+enum ClickPatternError_ { CLICK_PATTERN_ERROR_SYNTAX,
+    CLICK_PATTERN_ERROR_METER };
+
+GQuark click_pattern_error_quark (void);
+
+ClickTrack *click_pattern_compile (const char *pattern, unsigned int ppq,
+        GError **error);
+void click_pattern_clear_cache (void);
+
+#endif // __CLICK_PATTERN_H__
@@ -21,188 +21,600 @@
 
 typedef struct Click_ Click;
 
+/*
+ * A click track is made of layers played together, the first layer has the
+ * measures of the click program and the others are polyrhythms against it.
+ * Each layer is compiled into one flat array of clicks covering a cycle that
+ * repeats forever. A lookup table maps each slot of 2^lookup_shift ticks in
+ * the cycle to the first click at or after the slot, so any tick can be
+ * mapped to a click in O(1).
+ */
 struct Click_
 {
-    unsigned int tick;
+    unsigned int tick;  // Tick within the cycle
     ClickType type;
     ClickBarType bar_type;
+    unsigned int measure;  // Index of the measure the click is in
 };
 
 struct TrackMeasure_
 {
-    int n_clicks;  // Nr of clicks in measure
-    Click *clicks;  // Array of clicks, increasing tick
+    unsigned int start_tick;  // Tick within the cycle
     unsigned int length;  // Length of measure in ticks
+    unsigned int first_click;  // Index of the click at the measure start
+};
+
+struct ClickLayer_
+{
+    Click *clicks;  // Increasing tick
+    unsigned int n_clicks;
+    TrackMeasure *measures;
+    unsigned int n_measures;
+    unsigned int cycle_length;  // Length of all measures in ticks
+
+    unsigned int *lookup;
+    unsigned int n_lookup_slots;
+    unsigned int lookup_shift;
+
+    int channel;  // MIDI channel and note to play clicks with
+    int note;
 };
 
 struct ClickTrack_
 {
-    GList *measures;
+    ClickLayer **layers;
+    unsigned int n_layers;
+    unsigned int ppq;  // Ticks per beat
+
+    TempoMap *tempo_map;  // NULL if the click track has no tempo
+
+    volatile gint ref_count;
 };
 
+struct ClickTrackBuilder_
+{
+    GArray *clicks;
+    GArray *measures;
+    unsigned int length;  // Ticks of all measures so far
+    unsigned int ppq;
+};
 
-ClickTrack *click_track_create (
-        int beats_per_measure, 
-        ClickSubdivision subdivision)
+/*
+ * Builds the tick lookup table. The slots are no longer than the shortest
+ * distance between two clicks, so a slot never has more than one click.
+ */
+static void
+compile_lookup (ClickLayer *layer)
 {
-    ClickTrack *click_track = g_malloc (sizeof (ClickTrack));
-    click_track->measures = NULL;
+    unsigned int min_distance = layer->cycle_length;
+    for (unsigned int i = 0; i + 1 < layer->n_clicks; ++i)
+    {
+        unsigned int distance = layer->clicks[i + 1].tick -
+            layer->clicks[i].tick;
+        min_distance = MIN (min_distance, distance);
+    }
 
-    int n_subclicks = 0;
-    switch (subdivision)
+    layer->lookup_shift = 0;
+    while ((2u << layer->lookup_shift) <= min_distance)
     {
-        case SUB_ONE:
-            n_subclicks = 1;
-            break;
-        case SUB_TWO:
-            n_subclicks = 2;
-            break;
-        case SUB_SHUFFLE:
-            n_subclicks = 2;
-            break;
-        case SUB_THREE:
-            n_subclicks = 3;
-            break;
-        case SUB_FOUR:
-            n_subclicks = 4;
-            break;
+        layer->lookup_shift++;
     }
 
-    TrackMeasure *measure = g_malloc (sizeof (TrackMeasure));
-    measure->n_clicks = beats_per_measure * n_subclicks;
-    measure->clicks = g_malloc (sizeof (Click) * beats_per_measure *
-            n_subclicks);
-    measure->length = beats_per_measure * 96;
+    unsigned int slot_length = 1 << layer->lookup_shift;
+    layer->n_lookup_slots = (layer->cycle_length +
+            slot_length - 1) / slot_length;
+    layer->lookup = g_malloc (sizeof (unsigned int) *
+            layer->n_lookup_slots);
 
-    unsigned int subclick_step = 96 / n_subclicks;
-    if (subdivision == SUB_SHUFFLE)
+    unsigned int n_click = 0;
+    for (unsigned int slot = 0; slot < layer->n_lookup_slots; ++slot)
     {
-        subclick_step = 96 / 3;
+        unsigned int slot_start = slot << layer->lookup_shift;
+        while (n_click < layer->n_clicks &&
+                layer->clicks[n_click].tick < slot_start)
+        {
+            n_click++;
+        }
+        layer->lookup[slot] = n_click;
     }
-    unsigned int tick = 0;
+}
+
+/**
+ * Creates a builder for a click track of arbitrary measures and clicks, with
+ * ppq ticks per beat.
+ */
+ClickTrackBuilder *click_track_builder_new (unsigned int ppq)
+{
+    g_assert (ppq > 0);
+
+    ClickTrackBuilder *builder = g_malloc (sizeof (ClickTrackBuilder));
+    builder->clicks = g_array_new (FALSE, FALSE, sizeof (Click));
+    builder->measures = g_array_new (FALSE, FALSE, sizeof (TrackMeasure));
+    builder->length = 0;
+    builder->ppq = ppq;
+
+    return builder;
+}
+
+/**
+ * Starts a new measure of length ticks after the previous one. The measure
+ * must begin with a click.
+ */
+void click_track_builder_begin_measure (ClickTrackBuilder *builder,
+        unsigned int length)
+{
+    g_assert (length > 0);
+
+    TrackMeasure measure = { start_tick: builder->length, length: length,
+        first_click: builder->clicks->len };
+    g_array_append_val (builder->measures, measure);
+
+    builder->length += length;
+}
+
+/**
+ * Adds a click at tick relative to the start of the current measure. Clicks
+ * must be added in increasing tick order.
+ */
+void click_track_builder_add_click (ClickTrackBuilder *builder,
+        unsigned int tick, ClickType type, ClickBarType bar_type)
+{
+    g_assert (builder->measures->len > 0);
+
+    unsigned int n_measure = builder->measures->len - 1;
+    const TrackMeasure *measure = &g_array_index (builder->measures,
+            TrackMeasure, n_measure);
+    g_assert (tick < measure->length);
 
-    for (int i = 0; i < measure->n_clicks; ++i)
+    Click click = { tick: measure->start_tick + tick, type: type,
+        bar_type: bar_type, measure: n_measure };
+
+    if (builder->clicks->len == measure->first_click)
     {
-        measure->clicks[i].tick = tick;
+        g_assert (tick == 0);
+    }
+    else
+    {
+        g_assert (click.tick > g_array_index (builder->clicks, Click,
+                    builder->clicks->len - 1).tick);
+    }
 
-        ClickType type = CLICK_NORMAL;
-        ClickBarType bar_type = BAR_NORMAL;
-        if (tick == 0)
-        {
-            type = CLICK_ACCENTED;
-            bar_type = BAR_MEASURE_START;
-        }
-        else if (tick % 96 != 0)
+    g_array_append_val (builder->clicks, click);
+}
+
+/**
+ * Compiles the click track and frees the builder.
+ */
+ClickTrack *click_track_builder_finish (ClickTrackBuilder *builder)
+{
+    g_assert (builder->measures->len > 0);
+
+    ClickLayer *layer = g_malloc (sizeof (ClickLayer));
+
+    layer->cycle_length = builder->length;
+    layer->n_clicks = builder->clicks->len;
+    layer->clicks = (Click *) g_array_free (builder->clicks, FALSE);
+    layer->n_measures = builder->measures->len;
+    layer->measures = (TrackMeasure *) g_array_free (builder->measures, FALSE);
+    layer->channel = CLICK_TRACK_DEFAULT_CHANNEL;
+    layer->note = CLICK_TRACK_DEFAULT_NOTE;
+
+    compile_lookup (layer);
+
+    ClickTrack *click_track = g_malloc (sizeof (ClickTrack));
+    click_track->layers = g_new (ClickLayer *, 1);
+    click_track->layers[0] = layer;
+    click_track->n_layers = 1;
+    click_track->ppq = builder->ppq;
+    click_track->tempo_map = NULL;
+    click_track->ref_count = 1;
+
+    g_free (builder);
+
+    return click_track;
+}
+
+/*
+ * Adds the clicks of one beat, subdivided according to subdivision.
+ */
+static void
+add_beat_clicks (ClickTrackBuilder *builder,
+        unsigned int tick,
+        unsigned int beat_length,
+        ClickType type,
+        ClickBarType bar_type,
+        ClickSubdivision subdivision)
+{
+    static const unsigned int offsets[][4] = {
+        [SUB_ONE] = { 0 },
+        [SUB_TWO] = { 0, 6 },
+        [SUB_SHUFFLE] = { 0, 8 },
+        [SUB_THREE] = { 0, 4, 8 },
+        [SUB_FOUR] = { 0, 3, 6, 9 }
+    };
+    static const int n_subclicks[] = {
+        [SUB_ONE] = 1,
+        [SUB_TWO] = 2,
+        [SUB_SHUFFLE] = 2,
+        [SUB_THREE] = 3,
+        [SUB_FOUR] = 4
+    };
+
+    // Offsets are in twelfths of a beat, see click_track_create_program()
+    g_assert (beat_length % 12 == 0);
+
+    for (int i = 0; i < n_subclicks[subdivision]; ++i)
+    {
+        click_track_builder_add_click (builder,
+                tick + offsets[subdivision][i] * beat_length / 12,
+                type, bar_type);
+
+        type = CLICK_WEAK;
+        bar_type = BAR_SUB;
+    }
+}
+
+GQuark
+click_track_error_quark (void)
+{
+    return g_quark_from_static_string ("click-track-error-quark");
+}
+
+/**
+ * Creates a click track of a single measure repeated, with ppq ticks per
+ * beat. Returns NULL if a beat does not split into twelfths at ppq.
+ */
+ClickTrack *click_track_create (
+        int beats_per_measure, 
+        ClickSubdivision subdivision,
+        unsigned int ppq,
+        GError **error)
+{
+    ClickMeasureDef measure = { n_beats: beats_per_measure, beat_unit: 4,
+        subdivision: subdivision, accents: NULL, subdivisions: NULL };
+
+    return click_track_create_program (&measure, 1, ppq, error);
+}
+
+/**
+ * Creates a click track cycling through a program of measures, with ppq
+ * ticks per quarter note. Subdivisions are placed at twelfths of a beat, so
+ * NULL is returned with error set if a beat unit does not split into
+ * twelfths at ppq.
+ */
+ClickTrack *click_track_create_program (
+        const ClickMeasureDef *measures,
+        int n_measures,
+        unsigned int ppq,
+        GError **error)
+{
+    g_assert (n_measures > 0);
+
+    for (int i = 0; i < n_measures; ++i)
+    {
+        const ClickMeasureDef *def = &measures[i];
+        g_assert (def->n_beats > 0);
+
+        if (def->beat_unit <= 0 || (ppq * 4) % def->beat_unit != 0 ||
+                (ppq * 4 / def->beat_unit) % 12 != 0)
         {
-            type = CLICK_WEAK;
-            bar_type = BAR_SUB;
+            g_set_error (error, CLICK_TRACK_ERROR, CLICK_TRACK_ERROR_METER,
+                    "1/%d notes do not split into twelfths at %u ppq",
+                    def->beat_unit, ppq);
+            return NULL;
         }
-        measure->clicks[i].type = type;
-        measure->clicks[i].bar_type = bar_type;
+    }
+
+    ClickTrackBuilder *builder = click_track_builder_new (ppq);
 
-        if (subdivision == SUB_SHUFFLE && tick % 96 == 0)
+    for (int i = 0; i < n_measures; ++i)
+    {
+        const ClickMeasureDef *def = &measures[i];
+        unsigned int beat_length = ppq * 4 / def->beat_unit;
+
+        click_track_builder_begin_measure (builder,
+                def->n_beats * beat_length);
+
+        for (int beat = 0; beat < def->n_beats; ++beat)
         {
-            tick += subclick_step * 2;
+            ClickType type = beat == 0 ? CLICK_ACCENTED : CLICK_NORMAL;
+            if (def->accents != NULL)
+            {
+                type = def->accents[beat];
+            }
+
+            ClickSubdivision subdivision = def->subdivision;
+            if (def->subdivisions != NULL)
+            {
+                subdivision = def->subdivisions[beat];
+            }
+
+            add_beat_clicks (builder, beat * beat_length, beat_length, type,
+                    beat == 0 ? BAR_MEASURE_START : BAR_NORMAL,
+                    subdivision);
         }
-        else
+    }
+
+    return click_track_builder_finish (builder);
+}
+
+/**
+ * Adds a layer of n_pulses evenly spaced clicks over n_beats beats, e.g.
+ * 3 over 2 for a 3:2 polyrhythm, played with MIDI channel and note. Accents
+ * has the click type of each pulse, or is NULL to accent the first pulse.
+ * Returns the index of the layer.
+ */
+unsigned int click_track_add_layer (
+        ClickTrack *click_track,
+        int n_pulses,
+        int n_beats,
+        const ClickType *accents,
+        int channel,
+        int note)
+{
+    g_assert (n_pulses > 0);
+    g_assert (n_beats > 0);
+
+    ClickLayer *layer = g_malloc (sizeof (ClickLayer));
+
+    layer->cycle_length = n_beats * click_track->ppq;
+    layer->n_clicks = n_pulses;
+    layer->clicks = g_malloc (sizeof (Click) * n_pulses);
+    for (int i = 0; i < n_pulses; ++i)
+    {
+        Click *click = &layer->clicks[i];
+        click->tick = (unsigned int) i * layer->cycle_length / n_pulses;
+        click->type = i == 0 ? CLICK_ACCENTED : CLICK_NORMAL;
+        if (accents != NULL)
         {
-            tick += subclick_step;
+            click->type = accents[i];
         }
+        click->bar_type = i == 0 ? BAR_MEASURE_START : BAR_NORMAL;
+        click->measure = 0;
+    }
+
+    layer->measures = g_malloc (sizeof (TrackMeasure));
+    layer->measures->start_tick = 0;
+    layer->measures->length = layer->cycle_length;
+    layer->measures->first_click = 0;
+    layer->n_measures = 1;
+    layer->channel = channel;
+    layer->note = note;
+
+    compile_lookup (layer);
+
+    click_track->layers = g_renew (ClickLayer *, click_track->layers,
+            click_track->n_layers + 1);
+    click_track->layers[click_track->n_layers] = layer;
+
+    return click_track->n_layers++;
+}
+
+static void
+click_track_free (ClickTrack *click_track)
+{
+    for (unsigned int i = 0; i < click_track->n_layers; ++i)
+    {
+        ClickLayer *layer = click_track->layers[i];
+        g_free (layer->clicks);
+        g_free (layer->measures);
+        g_free (layer->lookup);
+        g_free (layer);
     }
+    g_free (click_track->layers);
+
+    if (click_track->tempo_map != NULL)
+    {
+        tempo_map_free (click_track->tempo_map);
+    }
+
+    g_free (click_track);
+}
 
-    click_track->measures = g_list_append (click_track->measures, measure);
+ClickTrack *click_track_ref (ClickTrack *click_track)
+{
+    g_atomic_int_inc (&click_track->ref_count);
 
     return click_track;
 }
 
-void click_track_free (ClickTrack *click_track)
+void click_track_unref (ClickTrack *click_track)
 {
-    GList *node = click_track->measures;
-    while (node != NULL)
+    if (g_atomic_int_dec_and_test (&click_track->ref_count))
     {
-        TrackMeasure *measure = node->data;
-        g_free (measure->clicks);
-        g_free (measure);
+        click_track_free (click_track);
+    }
+}
 
-        node = node->next;
+/**
+ * Returns the number of ticks per beat of click track.
+ */
+unsigned int click_track_get_ppq (const ClickTrack *click_track)
+{
+    return click_track->ppq;
+}
+
+/**
+ * Sets the tempo changes to play click track with. Takes ownership of
+ * tempo_map, which may be NULL to play with the tempo set by the player.
+ */
+void click_track_set_tempo_map (ClickTrack *click_track, TempoMap *tempo_map)
+{
+    g_assert (tempo_map == NULL ||
+            tempo_map_get_ppq (tempo_map) == click_track_get_ppq (click_track));
+
+    if (click_track->tempo_map != NULL)
+    {
+        tempo_map_free (click_track->tempo_map);
     }
+    click_track->tempo_map = tempo_map;
+}
 
-    g_list_free (click_track->measures);
+const TempoMap *click_track_get_tempo_map (const ClickTrack *click_track)
+{
+    return click_track->tempo_map;
+}
 
-    g_free (click_track);
+/**
+ * Returns the tick that measure n_measure, counted from the beginning of the
+ * click track, starts at.
+ */
+unsigned int click_track_measure_start_tick (const ClickTrack *click_track,
+        unsigned int n_measure)
+{
+    const ClickLayer *layer = click_track->layers[0];
+    unsigned int n_cycle = n_measure / layer->n_measures;
+    const TrackMeasure *measure =
+        &layer->measures[n_measure % layer->n_measures];
+
+    return n_cycle * layer->cycle_length + measure->start_tick;
+}
+
+unsigned int click_track_get_n_layers (const ClickTrack *click_track)
+{
+    return click_track->n_layers;
 }
 
 ClickTrackCursor click_track_begin (ClickTrack *click_track)
 {
-    ClickTrackCursor cursor = { click_track: click_track, measure_start_tick: 0,
-        measure_node: click_track->measures, n_click: 0 };
+    return click_track_layer_begin (click_track, 0);
+}
+
+/**
+ * Returns a cursor to the first click at or after tick. Takes constant time.
+ */
+ClickTrackCursor click_track_seek (ClickTrack *click_track, unsigned int tick)
+{
+    return click_track_layer_seek (click_track, 0, tick);
+}
+
+/**
+ * Returns a cursor to the first measure start at or after tick.
+ */
+ClickTrackCursor click_track_seek_measure (ClickTrack *click_track,
+        unsigned int tick)
+{
+    ClickTrackCursor cursor = click_track_seek (click_track, tick);
+    const ClickLayer *layer = cursor.layer;
+
+    unsigned int n_measure = layer->clicks[cursor.n_click].measure;
+    if (cursor.n_click != layer->measures[n_measure].first_click)
+    {
+        cursor = click_track_cursor_next_measure (cursor);
+    }
 
     return cursor;
 }
 
-ClickTrackCursor click_track_cursor_next_click (ClickTrackCursor cursor)
+ClickTrackCursor click_track_layer_begin (ClickTrack *click_track,
+        unsigned int n_layer)
 {
-    TrackMeasure *cur_measure = cursor.measure_node->data;
+    g_assert (n_layer < click_track->n_layers);
 
-    ClickTrackCursor new_cursor;
+    ClickTrackCursor cursor = { layer: click_track->layers[n_layer],
+        cycle_start_tick: 0, n_click: 0 };
 
-    if (cursor.n_click + 1 < cur_measure->n_clicks)
+    return cursor;
+}
+
+ClickTrackCursor click_track_layer_seek (ClickTrack *click_track,
+        unsigned int n_layer, unsigned int tick)
+{
+    g_assert (n_layer < click_track->n_layers);
+
+    ClickLayer *layer = click_track->layers[n_layer];
+    unsigned int cycle_offset = tick % layer->cycle_length;
+
+    ClickTrackCursor cursor = { layer: layer,
+        cycle_start_tick: tick - cycle_offset,
+        n_click: layer->lookup[cycle_offset >> layer->lookup_shift] };
+
+    // At most one click per slot
+    if (cursor.n_click < layer->n_clicks &&
+            layer->clicks[cursor.n_click].tick < cycle_offset)
     {
-        new_cursor.click_track = cursor.click_track;
-        new_cursor.measure_start_tick = cursor.measure_start_tick;
-        new_cursor.measure_node = cursor.measure_node;
-        new_cursor.n_click = cursor.n_click + 1;
+        cursor.n_click++;
     }
-    else
+
+    if (cursor.n_click == layer->n_clicks)
     {
-        new_cursor = click_track_cursor_next_measure (cursor);
+        cursor.n_click = 0;
+        cursor.cycle_start_tick += layer->cycle_length;
     }
 
-    return new_cursor;
+    return cursor;
 }
 
-ClickTrackCursor click_track_cursor_next_measure (ClickTrackCursor cursor)
+ClickTrackCursor click_track_cursor_next_click (ClickTrackCursor cursor)
 {
-    TrackMeasure *cur_measure = cursor.measure_node->data;
+    cursor.n_click++;
 
-    ClickTrackCursor new_cursor;
-    new_cursor.click_track = cursor.click_track;
-    new_cursor.measure_start_tick = cursor.measure_start_tick +
-        cur_measure->length;
-    new_cursor.n_click = 0;
-    if (cursor.measure_node->next != NULL)
+    if (cursor.n_click == cursor.layer->n_clicks)
     {
-        new_cursor.measure_node = cursor.measure_node->next;
+        cursor.n_click = 0;
+        cursor.cycle_start_tick += cursor.layer->cycle_length;
     }
-    else
+
+    return cursor;
+}
+
+/**
+ * Returns the cursor moved by ticks, for click tracks that start at another
+ * tick than 0.
+ */
+ClickTrackCursor click_track_cursor_shift (ClickTrackCursor cursor,
+        unsigned int ticks)
+{
+    cursor.cycle_start_tick += ticks;
+
+    return cursor;
+}
+
+ClickTrackCursor click_track_cursor_next_measure (ClickTrackCursor cursor)
+{
+    ClickLayer *layer = cursor.layer;
+    unsigned int n_measure = layer->clicks[cursor.n_click].measure + 1;
+
+    if (n_measure == layer->n_measures)
     {
-        new_cursor.measure_node = cursor.click_track->measures;
+        n_measure = 0;
+        cursor.cycle_start_tick += layer->cycle_length;
     }
+    cursor.n_click = layer->measures[n_measure].first_click;
 
-    return new_cursor;
+    return cursor;
 }
 
 unsigned int click_track_cursor_measure_length (ClickTrackCursor cursor)
 {
-    TrackMeasure *measure = cursor.measure_node->data;
-    return measure->length;
+    ClickLayer *layer = cursor.layer;
+    Click *click = &layer->clicks[cursor.n_click];
+
+    return layer->measures[click->measure].length;
 }
 
 unsigned int click_track_cursor_tick (ClickTrackCursor cursor)
 {
-    TrackMeasure *measure = cursor.measure_node->data;
-    return cursor.measure_start_tick + measure->clicks[cursor.n_click].tick;
+    return cursor.cycle_start_tick +
+        cursor.layer->clicks[cursor.n_click].tick;
 }
 
 ClickType click_track_cursor_click_type (ClickTrackCursor cursor)
 {
-    TrackMeasure *measure = cursor.measure_node->data;
-    return measure->clicks[cursor.n_click].type;
+    return cursor.layer->clicks[cursor.n_click].type;
 }
 
 ClickBarType click_track_cursor_bar_type (ClickTrackCursor cursor)
 {
-    TrackMeasure *measure = cursor.measure_node->data;
-    return measure->clicks[cursor.n_click].bar_type;
+    return cursor.layer->clicks[cursor.n_click].bar_type;
 }
 
+int click_track_cursor_channel (ClickTrackCursor cursor)
+{
+    return cursor.layer->channel;
+}
+
+int click_track_cursor_note (ClickTrackCursor cursor)
+{
+    return cursor.layer->note;
+}
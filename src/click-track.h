@@ -20,41 +20,107 @@
 #ifndef __CLICK_TRACK_H__
 #define __CLICK_TRACK_H__
 
+#include "tempo-map.h"
 #include <glib.h>
 
+#define CLICK_TRACK_DEFAULT_CHANNEL 10
+#define CLICK_TRACK_DEFAULT_NOTE 24
+#define CLICK_TRACK_DEFAULT_PPQ 96  // Ticks per beat
+
 typedef struct ClickTrack_ ClickTrack;
+typedef struct ClickLayer_ ClickLayer;
 typedef struct TrackMeasure_ TrackMeasure;
 typedef struct ClickTrackCursor_ ClickTrackCursor;
+typedef struct ClickMeasureDef_ ClickMeasureDef;
+typedef struct ClickTrackBuilder_ ClickTrackBuilder;
+
+#define CLICK_TRACK_ERROR click_track_error_quark ()
 
 typedef enum ClickSubdivision_ ClickSubdivision;
 typedef enum ClickType_ ClickType;
 typedef enum ClickBarType_ ClickBarType;
+typedef enum ClickTrackError_ ClickTrackError;
 
 struct ClickTrackCursor_
 {
     /* Private */
-    ClickTrack *click_track;
-    unsigned int measure_start_tick;
-    GList *measure_node;
-    int n_click;
+    ClickLayer *layer;
+    unsigned int cycle_start_tick;
+    unsigned int n_click;
 };
 
 enum ClickSubdivision_ { SUB_ONE, SUB_TWO, SUB_SHUFFLE, SUB_THREE, SUB_FOUR };
-enum ClickType_ { CLICK_NORMAL, CLICK_ACCENTED, CLICK_WEAK };
+enum ClickType_ { CLICK_NORMAL, CLICK_ACCENTED, CLICK_WEAK, CLICK_SILENT };
 enum ClickBarType_ { BAR_MEASURE_START, BAR_NORMAL, BAR_SUB, BAR_NONE };
+enum ClickTrackError_ { CLICK_TRACK_ERROR_METER };
+
+/*
+ * Definition of one measure in a click program, e.g. 7/8 is n_beats 7 and
+ * beat_unit 8. Per beat accents and subdivisions are optional, by default
+ * the first beat is accented and all beats use subdivision.
+ */
+struct ClickMeasureDef_
+{
+    int n_beats;
+    int beat_unit;
+    ClickSubdivision subdivision;
+    const ClickType *accents;  // n_beats click types or NULL
+    const ClickSubdivision *subdivisions;  // n_beats subdivisions or NULL
+};
+
+GQuark click_track_error_quark (void);
 
 ClickTrack *click_track_create (
         int beats_per_measure,
-        ClickSubdivision subdivision);
-void click_track_free (ClickTrack *click_track);
+        ClickSubdivision subdivision,
+        unsigned int ppq,
+        GError **error);
+ClickTrack *click_track_create_program (
+        const ClickMeasureDef *measures,
+        int n_measures,
+        unsigned int ppq,
+        GError **error);
+ClickTrackBuilder *click_track_builder_new (unsigned int ppq);
+void click_track_builder_begin_measure (ClickTrackBuilder *builder,
+        unsigned int length);
+void click_track_builder_add_click (ClickTrackBuilder *builder,
+        unsigned int tick, ClickType type, ClickBarType bar_type);
+ClickTrack *click_track_builder_finish (ClickTrackBuilder *builder);
+
+unsigned int click_track_add_layer (
+        ClickTrack *click_track,
+        int n_pulses,
+        int n_beats,
+        const ClickType *accents,
+        int channel,
+        int note);
+ClickTrack *click_track_ref (ClickTrack *click_track);
+void click_track_unref (ClickTrack *click_track);
+unsigned int click_track_get_ppq (const ClickTrack *click_track);
+void click_track_set_tempo_map (ClickTrack *click_track, TempoMap *tempo_map);
+const TempoMap *click_track_get_tempo_map (const ClickTrack *click_track);
+unsigned int click_track_measure_start_tick (const ClickTrack *click_track,
+        unsigned int n_measure);
+unsigned int click_track_get_n_layers (const ClickTrack *click_track);
 ClickTrackCursor click_track_begin (ClickTrack *click_track);
+ClickTrackCursor click_track_seek (ClickTrack *click_track, unsigned int tick);
+ClickTrackCursor click_track_seek_measure (ClickTrack *click_track,
+        unsigned int tick);
+ClickTrackCursor click_track_layer_begin (ClickTrack *click_track,
+        unsigned int n_layer);
+ClickTrackCursor click_track_layer_seek (ClickTrack *click_track,
+        unsigned int n_layer, unsigned int tick);
 
 ClickTrackCursor click_track_cursor_next_click (ClickTrackCursor cursor);
+ClickTrackCursor click_track_cursor_shift (ClickTrackCursor cursor,
+        unsigned int ticks);
 ClickTrackCursor click_track_cursor_next_measure (ClickTrackCursor cursor);
 unsigned int click_track_cursor_measure_length (ClickTrackCursor cursor);
 unsigned int click_track_cursor_tick (ClickTrackCursor cursor);
 ClickType click_track_cursor_click_type (ClickTrackCursor cursor);
 ClickBarType click_track_cursor_bar_type (ClickTrackCursor cursor);
+int click_track_cursor_channel (ClickTrackCursor cursor);
+int click_track_cursor_note (ClickTrackCursor cursor);
 
 #endif // __CLICK_TRACK_H__
 
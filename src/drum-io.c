@@ -18,41 +18,119 @@
  */
 
 #include "drum-io.h"
+#include "audio-click.h"
+#include "note-ring.h"
+#include "latency-stats.h"
+#include "queue-clock.h"
+#include "tempo-map.h"
 
 #include <glib.h>
 #include <alsa/asoundlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #define MIDI_NOP 0
 
-#define OUTPUT_MARGIN 96
+#define DEFAULT_PPQ CLICK_TRACK_DEFAULT_PPQ
+#define DEFAULT_BPM 120  // ALSA default
+#define CLICK_LOOKAHEAD 250000  // us of clicks to keep scheduled
+#define CLICK_REFILL_INTERVAL (CLICK_LOOKAHEAD / 2)  // us
+#define QUEUE_SYNC_INTERVAL 100000  // us between queue status requests
+
+#define NOTE_RING_SIZE 4096
+#define NOTE_POOL_SIZE 256
+#define IO_THREAD_POLL_TIMEOUT 10  // ms
+#define IO_THREAD_PRIORITY 10  // Above the minimum SCHED_FIFO priority
 
 static snd_seq_t *seq = NULL;
 static int out_port_id = -1;
 static int queue_id = -1;
+static unsigned int queue_ppq = DEFAULT_PPQ;
+static snd_seq_addr_t input_sender;  // Subscribed to the input port
+static snd_seq_addr_t input_dest;
+static gboolean real_time_input = FALSE;  // Input stamped with real time
+static gboolean audio_click = FALSE;  // Clicks played by audio-click.c
+
+static TempoMap *g_tempo_map = NULL;  // Set by the player
+static TempoMap *playback_tempo_map = NULL;  // Used by the I/O while running
+static guint next_tempo_change = 0;  // First change not in the queue
 
 static DsDrumtrack *drumtrack = NULL;
-static ClickTrack *g_click_track = NULL;
-static ClickTrackCursor g_cursor;
+
+// Notes read by the main loop are collected here and handed over to the
+// drumtrack in batches, so the input path never allocates. Only used from
+// the main loop.
+static DrumNote note_pool[NOTE_POOL_SIZE];
+static guint n_pooled_notes = 0;
+
+/*
+ * A click track set by drum_io_set_click_track(). Click tracks set while
+ * running are published to the I/O, which starts playing them at the next
+ * measure. The UI thread frees them once the I/O is done with them, see
+ * reclaim_click_tracks().
+ */
+typedef struct _PublishedClickTrack PublishedClickTrack;
+
+struct _PublishedClickTrack
+{
+    ClickTrack *click_track;
+    gint seq;  // Order in which click tracks were set
+    guint32 origin;  // Tick the click track starts at, set by the I/O
+    PublishedClickTrack *previous;  // Played before origin, set by the I/O
+};
+
+static GQueue published_click_tracks = G_QUEUE_INIT;  // Increasing seq
+static PublishedClickTrack *g_click_track = NULL;  // The last one set
+static gint click_track_seq = 0;
+static volatile gpointer pending_click_track = NULL;  // UI -> I/O
+static volatile gpointer playing_click_track = NULL;  // I/O -> UI
+static volatile gint oldest_used_click_track = 0;  // Lowest seq the I/O uses
+
+// Only used by the I/O
+static PublishedClickTrack *next_click_track = NULL;  // Starts at switch_tick
+static guint32 switch_tick = 0;
+static ClickTrackCursor *g_cursors = NULL;  // One per layer, heap by tick
+static guint n_cursors = 0;
+
 static gboolean running = FALSE;
 
-static inline DrumType
-midi_note_to_drum (unsigned char midi_note)
+// I/O thread, the UI thread only accesses the volatile variables and the
+// consumer side of the note ring while the thread is running.
+static gboolean use_thread = FALSE;
+static GThread *io_thread = NULL;
+static NoteRing *note_ring = NULL;
+static volatile gint thread_quit = FALSE;
+static volatile gint pending_bpm = 0;
+static QueueClock *queue_clock = NULL;  // Synced by the I/O, read by the UI
+static gint64 next_clock_sync = 0;  // Only used by the I/O
+static gdouble last_fractional_tick = 0;  // Only used by the UI
+static int wakeup_fds[2] = { -1, -1 };  // I/O thread -> main loop
+static volatile gint wakeup_pending = FALSE;
+
+// Statistics, see DrumIoStats
+static volatile gint n_dropped_notes = 0;
+static volatile gint n_note_pool_exhausted = 0;
+static volatile gint n_clicks_scheduled = 0;
+static volatile gint n_output_flushes = 0;
+static volatile gint n_pool_full_retries = 0;
+static volatile gint unknown_note_counts[DRUM_MAP_N_NOTES];
+
+// The current DrumMap. Replaced maps are retired and freed when the I/O
+// thread can no longer be using them, see retire().
+static volatile gpointer current_drum_map = NULL;
+static volatile gint io_thread_cycles = 0;
+static GSList *retired_list = NULL;
+
+struct _Retired
 {
-    switch (midi_note)
-    {
-        case 26:
-        case 46:
-            return DRUM_HIHAT;
-        case 36:
-            return DRUM_KICK;
-        case 38:
-            return DRUM_SNARE;
+    gpointer data;
+    GDestroyNotify destroy;
+    gint cycle;  // io_thread_cycles when retired
+};
 
-        default:
-            printf ("Unknown note: %d\n", midi_note);
-            return DRUM_CRASH;
-    }
-}
+typedef struct _Retired Retired;
 
 static inline int 
 click_type_to_velocity (ClickType type)
@@ -65,91 +143,881 @@ click_type_to_velocity (ClickType type)
             return 80;
         case CLICK_WEAK:
             return 40;
+        case CLICK_SILENT:
+            return 0;
     }
 
     return 0;
 }
 
+/*
+ * Main loop source that handles drum I/O as soon as input arrives. See
+ * drum_io_source_new().
+ */
+typedef struct _DrumIoSource DrumIoSource;
+
+struct _DrumIoSource
+{
+    GSource source;
+
+    GPollFD *seq_fds;
+    int n_seq_fds;
+    gboolean seq_fds_added;
+    GPollFD wakeup_fd;
+
+    gint64 next_refill;  // us, when to fill up the click output again
+};
+
+static DrumIoSource *g_io_source = NULL;
+
+static gboolean
+data_pending (void)
+{
+    return snd_seq_event_input_pending (seq, TRUE) != 0;
+}
+
+/*
+ * Reads one event. Returns TRUE and fills in note if it was a note.
+ * Wakeup_time is when the caller woke up to read input.
+ */
+static gboolean
+get_note (DrumNote *note, gint64 wakeup_time)
+{
+#if !MIDI_NOP
+    snd_seq_event_t *ev;
+    int err;
+
+    err = snd_seq_event_input (seq, &ev);
+    assert (err >= 0);
+
+    if (ev->type == SND_SEQ_EVENT_NOTEON)
+    {
+        int drum = drum_map_lookup (g_atomic_pointer_get (&current_drum_map),
+                ev->data.note.channel, ev->data.note.note);
+        if (drum == DRUM_MAP_UNKNOWN)
+        {
+            g_atomic_int_inc (
+                    &unknown_note_counts[ev->data.note.note & 0x7f]);
+            return FALSE;
+        }
+
+        note->drum = drum;
+        note->tick = ev->time.tick;
+        note->tick_fraction = 0;
+        if (snd_seq_ev_is_real (ev))
+        {
+            // The tempo map is only there while running
+            gint64 usec = (gint64) ev->time.time.tv_sec * G_USEC_PER_SEC +
+                ev->time.time.tv_nsec / 1000;
+            gdouble tick = playback_tempo_map == NULL ? 0 :
+                tempo_map_usec_to_fractional_tick (playback_tempo_map, usec);
+
+            note->tick = tick;
+            note->tick_fraction = tick - note->tick;
+        }
+        note->velocity = ev->data.note.velocity << (32 - 7);
+        note->arrival_time = latency_stats_now ();
+
+        latency_stats_record (LATENCY_INGEST,
+                note->arrival_time - wakeup_time);
+
+        return TRUE;
+    }
+
+#endif
+    return FALSE;
+}
+
+/*
+ * Syncs the queue clock with the real time of the queue.
+ */
+static void
+sync_queue_clock (void)
+{
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca (&status);
+
+    gint64 before = latency_stats_now ();
+    snd_seq_get_queue_status (seq, queue_id, status);
+    gint64 after = latency_stats_now ();
+
+    const snd_seq_real_time_t *time =
+        snd_seq_queue_status_get_real_time (status);
+    gint64 queue_usec = (gint64) time->tv_sec * G_USEC_PER_SEC +
+        time->tv_nsec / 1000;
+
+    queue_clock_sync (queue_clock, before + (after - before) / 2, queue_usec,
+            playback_tempo_map);
+    next_clock_sync = after + QUEUE_SYNC_INTERVAL;
+}
+
+/*
+ * Returns the current position in ticks, extrapolated by the queue clock
+ * between syncs. Only called by the I/O while running.
+ */
+static gdouble
+poll_queue_clock (void)
+{
+    gint64 now = latency_stats_now ();
+    if (now >= next_clock_sync)
+    {
+        sync_queue_clock ();
+        now = latency_stats_now ();
+    }
+
+    return queue_clock_get_tick (queue_clock, now);
+}
+
+static inline guint32
+get_current_tick (void)
+{
+    return poll_queue_clock ();
+}
+
+static void
+change_tempo (unsigned int tempo)
+{
+    int err = snd_seq_change_queue_tempo (seq, queue_id, tempo, NULL);
+    assert (err >= 0);
+    err = snd_seq_drain_output (seq);
+    assert (err >= 0);
+}
+
+static gboolean
+put_click (const DrumClick *click)
+{
+    if (audio_click)
+    {
+        gint64 usec = tempo_map_tick_to_usec (playback_tempo_map,
+                click->tick);
+        gboolean accented = (int) click->velocity >=
+            click_type_to_velocity (CLICK_ACCENTED);
+        return audio_click_push (usec, click->velocity, accented,
+                click->note != CLICK_TRACK_DEFAULT_NOTE);
+    }
+
+    snd_seq_event_t ev;
+    snd_seq_ev_clear (&ev);
+
+    snd_seq_ev_set_source (&ev, out_port_id);
+    snd_seq_ev_set_subs (&ev);
+    snd_seq_ev_schedule_tick (&ev, queue_id, 0, click->tick);
+    snd_seq_ev_set_note (&ev, click->channel, click->note, click->velocity,
+            48);
+
+    int err = snd_seq_event_output (seq, &ev);
+    return err >= 0;
+}
+
+static gboolean
+put_tempo (guint32 tick, unsigned int tempo)
+{
+    snd_seq_event_t ev;
+    snd_seq_ev_clear (&ev);
+
+    snd_seq_ev_set_source (&ev, out_port_id);
+    snd_seq_ev_set_queue_tempo (&ev, queue_id, tempo);
+    snd_seq_ev_schedule_tick (&ev, queue_id, 0, tick);
+
+    int err = snd_seq_event_output (seq, &ev);
+    return err >= 0;
+}
+
+/*
+ * Moves the cursor at index down the cursor heap until no child has an
+ * earlier tick.
+ */
+static void
+sift_down_cursor (guint index)
+{
+    ClickTrackCursor cursor = g_cursors[index];
+    guint32 tick = click_track_cursor_tick (cursor);
+
+    while (2 * index + 1 < n_cursors)
+    {
+        guint child = 2 * index + 1;
+        if (child + 1 < n_cursors &&
+                click_track_cursor_tick (g_cursors[child + 1]) <
+                click_track_cursor_tick (g_cursors[child]))
+        {
+            child++;
+        }
+
+        if (click_track_cursor_tick (g_cursors[child]) >= tick)
+        {
+            break;
+        }
+
+        g_cursors[index] = g_cursors[child];
+        index = child;
+    }
+
+    g_cursors[index] = cursor;
+}
+
+/*
+ * Puts a cursor for each layer of the click track started at origin in the
+ * cursor heap, at the first click at or after tick.
+ */
+static void
+seek_cursors (ClickTrack *click_track, guint32 origin, guint32 tick)
+{
+    n_cursors = click_track_get_n_layers (click_track);
+    g_cursors = g_renew (ClickTrackCursor, g_cursors, n_cursors);
+
+    tick = MAX (tick, origin);
+    for (guint i = 0; i < n_cursors; ++i)
+    {
+        g_cursors[i] = click_track_cursor_shift (
+                click_track_layer_seek (click_track, i, tick - origin),
+                origin);
+    }
+
+    for (guint i = n_cursors / 2; i-- > 0;)
+    {
+        sift_down_cursor (i);
+    }
+}
+
+/*
+ * Removes the clicks at or after tick that are waiting in the queue or in the
+ * output buffer. Clicks are queued as note events, which are only split into
+ * note on and off when they are dispatched, so tempo changes and the note
+ * offs of clicks already played are kept.
+ */
+static void
+remove_queued_clicks (guint32 tick)
+{
+    snd_seq_remove_events_t *remove;
+    snd_seq_remove_events_alloca (&remove);
+
+    snd_seq_timestamp_t time = { tick: tick };
+    snd_seq_remove_events_set_condition (remove, SND_SEQ_REMOVE_OUTPUT |
+            SND_SEQ_REMOVE_TIME_AFTER | SND_SEQ_REMOVE_TIME_TICK |
+            SND_SEQ_REMOVE_EVENT_TYPE);
+    snd_seq_remove_events_set_queue (remove, queue_id);
+    snd_seq_remove_events_set_time (remove, &time);
+    snd_seq_remove_events_set_event_type (remove, SND_SEQ_EVENT_NOTE);
+
+    int err = snd_seq_remove_events (seq, remove);
+    assert (err >= 0);
+
+    if (audio_click)
+    {
+        audio_click_cancel (tempo_map_tick_to_usec (playback_tempo_map,
+                    tick));
+    }
+}
+
+/*
+ * Takes a click track published while running and lets it replace the
+ * playing one at the first measure start after current_tick. Queued clicks
+ * from that measure on are removed.
+ */
+static void
+take_pending_click_track (guint32 current_tick)
+{
+    PublishedClickTrack *published = g_atomic_pointer_get (
+            &pending_click_track);
+    if (published == NULL || !g_atomic_pointer_compare_and_exchange (
+                &pending_click_track, published, NULL))
+    {
+        return;
+    }
+
+    // One waiting for the measure start is replaced, it was never played
+    if (next_click_track == NULL)
+    {
+        PublishedClickTrack *playing = playing_click_track;
+
+        switch_tick = current_tick;
+        if (playing != NULL && current_tick >= playing->origin)
+        {
+            ClickTrackCursor measure = click_track_seek_measure (
+                    playing->click_track,
+                    current_tick + 1 - playing->origin);
+            switch_tick = click_track_cursor_tick (measure) + playing->origin;
+        }
+        else if (playing != NULL)
+        {
+            // The playing click track has not started yet, replace it
+            switch_tick = playing->origin;
+        }
+
+        remove_queued_clicks (switch_tick);
+    }
+
+    next_click_track = published;
+}
+
+/*
+ * Starts playing the click track that was waiting for switch_tick.
+ */
+static void
+switch_click_track (void)
+{
+    PublishedClickTrack *playing = playing_click_track;
+    PublishedClickTrack *next = next_click_track;
+
+    next->origin = switch_tick;
+    next->previous = playing;
+    if (playing != NULL && playing->origin == switch_tick)
+    {
+        // Playing never started
+        next->previous = playing->previous;
+    }
+
+    seek_cursors (next->click_track, switch_tick, switch_tick);
+    next_click_track = NULL;
+
+    g_atomic_pointer_set (&playing_click_track, next);
+    g_atomic_int_set (&oldest_used_click_track, next->previous != NULL ?
+            next->previous->seq : next->seq);
+}
+
+/*
+ * Removes the tempo events that are waiting in the queue or in the output
+ * buffer.
+ */
+static void
+remove_queued_tempo_changes (void)
+{
+    snd_seq_remove_events_t *remove;
+    snd_seq_remove_events_alloca (&remove);
+
+    snd_seq_remove_events_set_condition (remove,
+            SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_EVENT_TYPE);
+    snd_seq_remove_events_set_queue (remove, queue_id);
+    snd_seq_remove_events_set_event_type (remove, SND_SEQ_EVENT_TEMPO);
+
+    int err = snd_seq_remove_events (seq, remove);
+    assert (err >= 0);
+}
+
+/*
+ * Replaces the rest of the playback tempo map with a tempo set by
+ * drum_io_set_playback_tempo() while running. Audio clicks are timed in us,
+ * so those after current_tick are cancelled and scheduled again.
+ */
+static void
+apply_pending_tempo (guint32 current_tick)
+{
+    gint bpm = g_atomic_int_get (&pending_bpm);
+    if (bpm == 0 ||
+            !g_atomic_int_compare_and_exchange (&pending_bpm, bpm, 0))
+    {
+        return;
+    }
+
+    // Clicks after current_tick are at least 1 us later with either map
+    gint64 cancel_time = tempo_map_tick_to_usec (playback_tempo_map,
+            current_tick) + 1;
+
+    remove_queued_tempo_changes ();
+    tempo_map_set_tempo (playback_tempo_map, current_tick, bpm);
+    next_tempo_change = tempo_map_find_change (playback_tempo_map,
+            current_tick);
+    queue_clock_set_tempo_map (queue_clock, playback_tempo_map);
+
+    PublishedClickTrack *playing = playing_click_track;
+    if (audio_click && playing != NULL)
+    {
+        audio_click_cancel (cancel_time);
+        seek_cursors (playing->click_track, playing->origin,
+                current_tick + 1);
+    }
+}
+
+/*
+ * Returns the tick CLICK_LOOKAHEAD after current_tick.
+ */
+static guint32
+get_lookahead_tick (guint32 current_tick)
+{
+    gint64 usec = tempo_map_tick_to_usec (playback_tempo_map, current_tick);
+    guint32 tick = tempo_map_usec_to_tick (playback_tempo_map,
+            usec + CLICK_LOOKAHEAD);
+
+    return MAX (tick, current_tick + 1);
+}
+
+/*
+ * Schedules the tempo changes and clicks up to CLICK_LOOKAHEAD from now. The
+ * clicks of all layers are merged in tick order through the cursor heap. The
+ * events are collected in the output buffer and sent with one drain. If the
+ * kernel pool is full the remaining events are retried on the next poll.
+ */
+static void 
+playback_poll (guint32 current_tick)
+{
+    apply_pending_tempo (current_tick);
+
+    guint32 stop_tick = get_lookahead_tick (current_tick);
+    gboolean pool_full = FALSE;
+
+    unsigned int tempo_tick;
+    unsigned int tempo;
+    while (!pool_full && tempo_map_get_change (playback_tempo_map,
+                next_tempo_change, &tempo_tick, &tempo) &&
+            tempo_tick < stop_tick)
+    {
+        if (put_tempo (tempo_tick, tempo))
+        {
+            next_tempo_change++;
+        }
+        else
+        {
+            g_atomic_int_inc (&n_pool_full_retries);
+            pool_full = TRUE;
+        }
+    }
+
+    take_pending_click_track (current_tick);
+
+    gint n_scheduled = 0;
+    for (;;)
+    {
+        guint32 click_stop_tick = stop_tick;
+        if (next_click_track != NULL)
+        {
+            click_stop_tick = MIN (stop_tick, switch_tick);
+        }
+
+        while (playing_click_track != NULL && !pool_full &&
+                click_track_cursor_tick (g_cursors[0]) < click_stop_tick)
+        {
+            ClickTrackCursor cursor = g_cursors[0];
+            int velocity = click_type_to_velocity (
+                    click_track_cursor_click_type (cursor));
+            DrumClick dclick = { velocity: velocity,
+                tick: click_track_cursor_tick (cursor),
+                channel: click_track_cursor_channel (cursor),
+                note: click_track_cursor_note (cursor) };
+
+            // Silent clicks are only drawn
+            if (velocity == 0 || put_click (&dclick))
+            {
+                g_cursors[0] = click_track_cursor_next_click (cursor);
+                sift_down_cursor (0);
+                n_scheduled += velocity != 0;
+            }
+            else
+            {
+                g_atomic_int_inc (&n_pool_full_retries);
+                pool_full = TRUE;
+            }
+        }
+
+        if (pool_full || next_click_track == NULL || switch_tick >= stop_tick)
+        {
+            break;
+        }
+
+        // Everything before the switch is scheduled
+        switch_click_track ();
+    }
+    g_atomic_int_add (&n_clicks_scheduled, n_scheduled);
+
+    if (snd_seq_event_output_pending (seq) > 0)
+    {
+        // Events that do not fit in the pool stay in the buffer
+        int err = snd_seq_drain_output (seq);
+        if (err == -EAGAIN)
+        {
+            g_atomic_int_inc (&n_pool_full_retries);
+        }
+        g_atomic_int_inc (&n_output_flushes);
+    }
+}
+
+/*
+ * Frees data with destroy once the I/O thread, if running, has finished the
+ * cycle it may currently be in. Data must no longer be reachable by the
+ * thread.
+ */
+static void
+retire (gpointer data, GDestroyNotify destroy)
+{
+    if (io_thread == NULL)
+    {
+        destroy (data);
+        return;
+    }
+
+    Retired *retired = g_slice_new (Retired);
+    retired->data = data;
+    retired->destroy = destroy;
+    retired->cycle = g_atomic_int_get (&io_thread_cycles);
+
+    retired_list = g_slist_prepend (retired_list, retired);
+}
+
+/*
+ * Frees retired data that the I/O thread can no longer be using. If
+ * reclaim_all is TRUE the thread must not be running.
+ */
+static void
+reclaim_retired (gboolean reclaim_all)
+{
+    gint cycle = g_atomic_int_get (&io_thread_cycles);
+
+    GSList *node = retired_list;
+    while (node != NULL)
+    {
+        GSList *next = node->next;
+        Retired *retired = node->data;
+
+        // A whole cycle must have started after the data was retired
+        if (reclaim_all || cycle - retired->cycle >= 2)
+        {
+            retired->destroy (retired->data);
+            g_slice_free (Retired, retired);
+            retired_list = g_slist_delete_link (retired_list, node);
+        }
+
+        node = next;
+    }
+}
+
+/*
+ * Frees the click tracks that the I/O can no longer be using. When drum I/O
+ * is not running only the last one set is kept.
+ */
+static void
+reclaim_click_tracks (void)
+{
+    if (g_click_track == NULL)
+    {
+        return;
+    }
+
+    gint oldest = running ? g_atomic_int_get (&oldest_used_click_track) :
+        g_click_track->seq;
+
+    PublishedClickTrack *published;
+    while ((published = g_queue_peek_head (&published_click_tracks)) != NULL &&
+            published->seq < oldest)
+    {
+        g_queue_pop_head (&published_click_tracks);
+        click_track_unref (published->click_track);
+        g_slice_free (PublishedClickTrack, published);
+    }
+}
+
+static void
+set_realtime_priority (void)
+{
+    struct sched_param param;
+    param.sched_priority = sched_get_priority_min (SCHED_FIFO) +
+        IO_THREAD_PRIORITY;
+
+    int err = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+    if (err != 0)
+    {
+        g_message ("Running I/O thread without realtime priority: %s",
+                g_strerror (err));
+    }
+}
+
+/*
+ * Blocks on the sequencer until input arrives or it is time to refill the
+ * click output. Notes are handed over to the UI thread through the note
+ * ring, the source from drum_io_source_new() picks them up.
+ */
+static gpointer
+io_thread_func (gpointer data)
+{
+    set_realtime_priority ();
+
+    int n_fds = snd_seq_poll_descriptors_count (seq, POLLIN);
+    struct pollfd *fds = g_new (struct pollfd, n_fds);
+    snd_seq_poll_descriptors (seq, fds, n_fds, POLLIN);
+
+    while (!g_atomic_int_get (&thread_quit))
+    {
+        poll (fds, n_fds, IO_THREAD_POLL_TIMEOUT);
+        gint64 wakeup_time = latency_stats_now ();
+
+        gboolean got_notes = FALSE;
+        while (data_pending ())
+        {
+            DrumNote note;
+            if (get_note (&note, wakeup_time))
+            {
+                if (note_ring_push (note_ring, &note))
+                {
+                    got_notes = TRUE;
+                }
+                else
+                {
+                    g_atomic_int_inc (&n_dropped_notes);
+                }
+            }
+        }
+
+        // Wake up the main loop unless it already has a wakeup pending
+        if (got_notes &&
+                g_atomic_int_compare_and_exchange (&wakeup_pending, FALSE, TRUE))
+        {
+            char byte = 0;
+            if (write (wakeup_fds[1], &byte, 1) != 1)
+            {
+                g_atomic_int_set (&wakeup_pending, FALSE);
+            }
+        }
+
+        playback_poll (get_current_tick ());
+
+        g_atomic_int_inc (&io_thread_cycles);
+    }
+
+    g_free (fds);
+
+    return NULL;
+}
+
+/*
+ * Hands the pooled notes over to the drumtrack and empties the pool.
+ */
+static void
+flush_note_pool (void)
+{
+    gint64 now = latency_stats_now ();
+    for (guint i = 0; i < n_pooled_notes; ++i)
+    {
+        latency_stats_record (LATENCY_HANDOFF,
+                now - note_pool[i].arrival_time);
+    }
+
+    if (drumtrack != NULL)
+    {
+        ds_drumtrack_append_notes (drumtrack, note_pool, n_pooled_notes);
+    }
+
+    n_pooled_notes = 0;
+}
+
+/*
+ * Returns the next free note in the pool. The note is not taken until
+ * n_pooled_notes is increased. If the pool is exhausted it is flushed
+ * first.
+ */
+static DrumNote*
+get_pool_note (void)
+{
+    if (n_pooled_notes == NOTE_POOL_SIZE)
+    {
+        g_atomic_int_inc (&n_note_pool_exhausted);
+        flush_note_pool ();
+    }
+
+    return &note_pool[n_pooled_notes];
+}
+
+static void
+drain_note_ring (void)
+{
+    guint n_notes;
+
+    do
+    {
+        n_notes = note_ring_pop (note_ring, get_pool_note (),
+                NOTE_POOL_SIZE - n_pooled_notes);
+        n_pooled_notes += n_notes;
+    }
+    while (n_notes > 0);
+
+    flush_note_pool ();
+}
+
+/*
+ * Reads all available input and adds the notes to the drumtrack. Input
+ * received while drum I/O is stopped is discarded.
+ */
+static void
+handle_input (void)
+{
+    if (drumtrack != NULL)
+    {
+        // Emit one "changed" for all notes read in this call
+        ds_drumtrack_freeze_changed (drumtrack);
+    }
+
+    if (io_thread != NULL)
+    {
+        char buffer[16];
+        while (read (wakeup_fds[0], buffer, sizeof (buffer)) > 0)
+        {
+        }
+        g_atomic_int_set (&wakeup_pending, FALSE);
+
+        drain_note_ring ();
+    }
+    else
+    {
+        gint64 wakeup_time = latency_stats_now ();
+        while (data_pending ())
+        {
+            if (get_note (get_pool_note (), wakeup_time) && running)
+            {
+                n_pooled_notes++;
+            }
+        }
+
+        flush_note_pool ();
+    }
+
+    if (drumtrack != NULL)
+    {
+        ds_drumtrack_thaw_changed (drumtrack);
+    }
+
+    reclaim_retired (FALSE);
+    reclaim_click_tracks ();
+}
+
+static gint64
+get_source_time (GSource *source)
+{
+    GTimeVal now;
+    g_source_get_current_time (source, &now);
+
+    return (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+
+static gboolean
+drum_io_source_prepare (GSource *source, gint *timeout)
+{
+    DrumIoSource *io_source = (DrumIoSource *) source;
+
+    *timeout = -1;
+
+    // Without the thread the click output must be filled up from here
+    if (running && io_thread == NULL)
+    {
+        gint64 remaining = io_source->next_refill - get_source_time (source);
+        if (remaining <= 0)
+        {
+            return TRUE;
+        }
+        *timeout = (remaining + 999) / 1000;
+    }
+
+    return FALSE;
+}
+
 static gboolean
-data_pending (void)
+drum_io_source_check (GSource *source)
 {
-    return snd_seq_event_input_pending (seq, TRUE) != 0;
+    DrumIoSource *io_source = (DrumIoSource *) source;
+
+    if (io_source->wakeup_fd.revents & G_IO_IN)
+    {
+        return TRUE;
+    }
+
+    if (io_source->seq_fds_added)
+    {
+        for (int i = 0; i < io_source->n_seq_fds; ++i)
+        {
+            if (io_source->seq_fds[i].revents & G_IO_IN)
+            {
+                return TRUE;
+            }
+        }
+    }
+
+    return running && io_thread == NULL &&
+        get_source_time (source) >= io_source->next_refill;
 }
 
-static DrumNote*
-get_note (void)
+static gboolean
+drum_io_source_dispatch (GSource *source, GSourceFunc callback,
+        gpointer user_data)
 {
-#if !MIDI_NOP
-    snd_seq_event_t *ev;
-    int err;
+    DrumIoSource *io_source = (DrumIoSource *) source;
 
-    err = snd_seq_event_input (seq, &ev);
-    assert (err >= 0);
+    handle_input ();
 
-    if (ev->type == SND_SEQ_EVENT_NOTEON)
+    if (running && io_thread == NULL)
     {
-        DrumNote *note = g_malloc (sizeof (DrumNote));
-        note->drum = midi_note_to_drum (ev->data.note.note);
-        note->tick = ev->time.tick;
-        note->velocity = ev->data.note.velocity << (32 - 7);
+        playback_poll (get_current_tick ());
+        io_source->next_refill = get_source_time (source) +
+            CLICK_REFILL_INTERVAL;
+    }
 
-        return note;
+    if (callback != NULL)
+    {
+        return callback (user_data);
     }
 
-#endif
-    return NULL;
+    return TRUE;
 }
 
-static guint32
-get_current_tick (void)
+static void
+drum_io_source_finalize (GSource *source)
 {
-    snd_seq_queue_status_t *status;
-    snd_seq_queue_status_alloca (&status);
-    snd_seq_get_queue_status (seq, queue_id, status);
-    return snd_seq_queue_status_get_tick_time (status);
+    DrumIoSource *io_source = (DrumIoSource *) source;
+
+    g_free (io_source->seq_fds);
+    g_io_source = NULL;
 }
 
-static gboolean
-put_click (const DrumClick *click)
+static GSourceFuncs drum_io_source_funcs =
 {
-    snd_seq_event_t ev;
-    snd_seq_ev_clear (&ev);
-
-    snd_seq_ev_set_source (&ev, out_port_id);
-    snd_seq_ev_set_subs (&ev);
-    snd_seq_ev_schedule_tick (&ev, queue_id, 0, click->tick);
-    snd_seq_ev_set_note (&ev, 10, 24, click->velocity, 48);
-
-    int err = snd_seq_event_output_direct (seq, &ev);
-    return err >= 0;
-}
+    drum_io_source_prepare,
+    drum_io_source_check,
+    drum_io_source_dispatch,
+    drum_io_source_finalize,
+    NULL,
+    NULL
+};
 
-static void 
-playback_poll (guint32 current_tick)
+/*
+ * The sequencer is only polled by the source when there is no I/O thread
+ * reading it.
+ */
+static void
+set_source_polls_seq (gboolean poll_seq)
 {
-    if (g_click_track != NULL)
+    if (g_io_source == NULL || g_io_source->seq_fds_added == poll_seq)
     {
-        gboolean buffer_full = FALSE;
-        while ((click_track_cursor_tick (g_cursor) < 
-                    (current_tick + OUTPUT_MARGIN)) && !buffer_full)
-        {
-            guint32 tick = click_track_cursor_tick (g_cursor);
-            int velocity = click_type_to_velocity (
-                    click_track_cursor_click_type (g_cursor));
-            DrumClick dclick = { velocity: velocity, tick: tick };
+        return;
+    }
 
-            //printf ("outputting: %d, %d\n", velocity, tick);
-            if (put_click (&dclick))
-            {
-                g_cursor = click_track_cursor_next_click (g_cursor);
-            }
-            else
-            {
-                printf ("Buffer full\n");
-                buffer_full = TRUE;
-            }
+    for (int i = 0; i < g_io_source->n_seq_fds; ++i)
+    {
+        GSource *source = (GSource *) g_io_source;
+        if (poll_seq)
+        {
+            g_source_add_poll (source, &g_io_source->seq_fds[i]);
+        }
+        else
+        {
+            g_source_remove_poll (source, &g_io_source->seq_fds[i]);
         }
     }
+
+    g_io_source->seq_fds_added = poll_seq;
+}
+
+/*
+ * Subscribes to the input port, with notes stamped with the queue time in
+ * ticks or in real time.
+ */
+static void
+subscribe_input (void)
+{
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca (&subs);
+    snd_seq_port_subscribe_set_sender (subs, &input_sender);
+    snd_seq_port_subscribe_set_dest (subs, &input_dest);
+    snd_seq_port_subscribe_set_queue (subs, queue_id);
+    snd_seq_port_subscribe_set_time_update (subs, 1);
+    snd_seq_port_subscribe_set_time_real (subs, real_time_input);
+
+    int err = snd_seq_subscribe_port (seq, subs);
+    assert (err >= 0);
 }
 
 /**
@@ -164,6 +1032,10 @@ void drum_io_init (int input_client, int input_port, int output_client,
     assert (err >= 0);
 
     snd_seq_set_client_name (seq, "drumscope");
+
+    // Only wake up for notes, not for clock, active sensing etc.
+    err = snd_seq_set_client_event_filter (seq, SND_SEQ_EVENT_NOTEON);
+    assert (err >= 0);
     int client_id = snd_seq_client_id (seq);
 
     out_port_id = snd_seq_create_simple_port (seq, "output",
@@ -179,35 +1051,156 @@ void drum_io_init (int input_client, int input_port, int output_client,
     queue_id = snd_seq_alloc_queue (seq);
     assert (queue_id >= 0);
 
+    note_ring = note_ring_new (NOTE_RING_SIZE);
+    queue_clock = queue_clock_new ();
+    g_tempo_map = tempo_map_new (queue_ppq, DEFAULT_BPM);
+    current_drum_map = drum_map_new_default ();
+
+    err = pipe (wakeup_fds);
+    assert (err >= 0);
+    fcntl (wakeup_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl (wakeup_fds[1], F_SETFL, O_NONBLOCK);
+
 #if !MIDI_NOP
     err = snd_seq_connect_to (seq, out_port_id, output_client, output_port);
     assert (err >= 0);
 
-    snd_seq_addr_t sender = { client: input_client, port: input_port };
-    snd_seq_addr_t dest = { client: client_id, port: in_port_id };
+    input_sender.client = input_client;
+    input_sender.port = input_port;
+    input_dest.client = client_id;
+    input_dest.port = in_port_id;
+    subscribe_input ();
+#endif
+
+}
+
+/**
+ * Sets the map used to translate MIDI notes to drums. Takes ownership of
+ * the map. May be called while drum I/O is running, notes read after the
+ * call returns use the new map.
+ */
+void
+drum_io_set_midi_to_drum_map (DrumMap *map)
+{
+    gpointer old_map = current_drum_map;
+
+    g_atomic_pointer_set (&current_drum_map, map);
+
+    retire (old_map, (GDestroyNotify) drum_map_free);
+}
+
+/**
+ * Selects if drum I/O should be handled by a separate thread. When it is, MIDI
+ * input and click output does not depend on the main loop, and the source
+ * from drum_io_source_new() only hands new notes over to the drumtrack. Must
+ * not be called when drum I/O is running.
+ */
+void
+drum_io_set_use_thread (gboolean new_use_thread)
+{
+    g_assert (!running);
+
+    use_thread = new_use_thread;
+}
+
+/**
+ * Sets the resolution of the queue in ticks per beat. Click tracks and tempo
+ * maps set after this must have the same resolution, and the tempo is kept.
+ * Must not be called when drum I/O is running.
+ */
+void
+drum_io_set_ppq (unsigned int ppq)
+{
+    g_assert (!running);
+    g_assert (ppq > 0);
+
+    snd_seq_queue_tempo_t *queue_tempo;
+    snd_seq_queue_tempo_alloca (&queue_tempo);
+
+    int err = snd_seq_get_queue_tempo (seq, queue_id, queue_tempo);
+    assert (err >= 0);
+    snd_seq_queue_tempo_set_ppq (queue_tempo, ppq);
+    err = snd_seq_set_queue_tempo (seq, queue_id, queue_tempo);
+    assert (err >= 0);
+
+    double bpm = 60.0e6 / tempo_map_get_tempo (g_tempo_map, 0);
+    tempo_map_free (g_tempo_map);
+    g_tempo_map = tempo_map_new (ppq, bpm);
+
+    queue_ppq = ppq;
+}
+
+/**
+ * Returns the resolution of the queue in ticks per beat.
+ */
+unsigned int
+drum_io_get_ppq (void)
+{
+    return queue_ppq;
+}
+
+/**
+ * Selects if notes are stamped with the real time of the queue instead of
+ * its tick, which gives them a position within the tick. Must not be called
+ * when drum I/O is running.
+ */
+void
+drum_io_set_real_time_input (gboolean new_real_time_input)
+{
+    g_assert (!running);
+
+    if (new_real_time_input == real_time_input)
+    {
+        return;
+    }
+    real_time_input = new_real_time_input;
+
+#if !MIDI_NOP
     snd_seq_port_subscribe_t *subs;
     snd_seq_port_subscribe_alloca (&subs);
-    snd_seq_port_subscribe_set_sender (subs, &sender);
-    snd_seq_port_subscribe_set_dest (subs, &dest);
-    snd_seq_port_subscribe_set_queue (subs, queue_id);
-    snd_seq_port_subscribe_set_time_update (subs, 1);
-    err = snd_seq_subscribe_port (seq, subs);
+    snd_seq_port_subscribe_set_sender (subs, &input_sender);
+    snd_seq_port_subscribe_set_dest (subs, &input_dest);
+
+    int err = snd_seq_unsubscribe_port (seq, subs);
     assert (err >= 0);
+    subscribe_input ();
 #endif
+}
+
+/**
+ * Plays the clicks as audio on the ALSA PCM device instead of sending them
+ * as MIDI notes, or sends them as MIDI again if device is NULL. Returns FALSE
+ * and sets error if the device could not be opened. Must not be called when
+ * drum I/O is running.
+ */
+gboolean
+drum_io_set_audio_click (const char *device, GError **error)
+{
+    g_assert (!running);
+
+    audio_click_close ();
+    audio_click = FALSE;
 
+    if (device == NULL)
+    {
+        return TRUE;
+    }
+
+    audio_click = audio_click_open (device, error);
+    return audio_click;
 }
 
 /**
- * Sets the drumtrack that will have notes added to it when polling. Must not
- * be called when drum I/O is running.
+ * Sets the drumtrack that will have notes added to it when polling. May be
+ * called while drum I/O is running, notes received before the call go to the
+ * previous drumtrack.
  */
 void
 drum_io_set_drumtrack (DsDrumtrack *new_drumtrack)
 {
-    g_assert (!running);
-
     if (drumtrack != NULL)
     {
+        flush_note_pool ();
         g_object_unref (drumtrack);
     }
 
@@ -216,22 +1209,82 @@ drum_io_set_drumtrack (DsDrumtrack *new_drumtrack)
 }
 
 /**
- * Sets the click track to play. Must not be called when drum I/O is running.
+ * Sets the click track to play, taking over the reference of the caller. If
+ * the click track has a tempo map it replaces the playback tempo from the next
+ * start. May be called while drum I/O is running, the click track then starts
+ * playing at the next measure of the playing one.
  */
 void
 drum_io_set_click_track (ClickTrack *click_track)
 {
-    g_assert (!running);
+    g_assert (click_track_get_ppq (click_track) == queue_ppq);
 
-    if (g_click_track != NULL)
+    PublishedClickTrack *published = g_slice_new (PublishedClickTrack);
+    published->click_track = click_track;
+    published->seq = ++click_track_seq;
+    published->origin = 0;
+    published->previous = NULL;
+
+    g_queue_push_tail (&published_click_tracks, published);
+    g_click_track = published;
+
+    if (running)
+    {
+        gpointer replaced;
+        do
+        {
+            replaced = g_atomic_pointer_get (&pending_click_track);
+        }
+        while (!g_atomic_pointer_compare_and_exchange (&pending_click_track,
+                    replaced, published));
+
+        // The I/O never saw the one replaced
+        if (replaced != NULL)
+        {
+            PublishedClickTrack *unused = replaced;
+            g_queue_remove (&published_click_tracks, unused);
+            click_track_unref (unused->click_track);
+            g_slice_free (PublishedClickTrack, unused);
+        }
+
+        if (io_thread == NULL)
+        {
+            playback_poll (get_current_tick ());
+        }
+    }
+    else
+    {
+        reclaim_click_tracks ();
+    }
+
+    const TempoMap *tempo_map = click_track_get_tempo_map (click_track);
+    if (tempo_map != NULL)
     {
-        click_track_free (g_click_track);
+        g_assert (tempo_map_get_ppq (tempo_map) == queue_ppq);
+
+        tempo_map_free (g_tempo_map);
+        g_tempo_map = tempo_map_copy (tempo_map);
     }
-    g_click_track = click_track;
 }
 
 /**
- * Sets the playback tempo. May be called while drum I/O is running.
+ * Sets the tempo changes to play with, taking ownership of tempo_map. Must
+ * not be called when drum I/O is running.
+ */
+void
+drum_io_set_tempo_map (TempoMap *tempo_map)
+{
+    g_assert (!running);
+    g_assert (tempo_map_get_ppq (tempo_map) == queue_ppq);
+
+    tempo_map_free (g_tempo_map);
+    g_tempo_map = tempo_map;
+}
+
+/**
+ * Sets a constant playback tempo. May be called while drum I/O is running,
+ * the change is then scheduled in the queue by the I/O and replaces the rest
+ * of any tempo changes.
  */
 void
 drum_io_set_playback_tempo (int bpm)
@@ -239,44 +1292,132 @@ drum_io_set_playback_tempo (int bpm)
     g_assert (bpm > 0);
     g_assert (bpm < 350);
 
-    unsigned int tempo = 60 * 1000000 / bpm;
+    tempo_map_free (g_tempo_map);
+    g_tempo_map = tempo_map_new (queue_ppq, bpm);
 
-    int err = snd_seq_change_queue_tempo (seq, queue_id, tempo, NULL);
-    assert (err >= 0);
-    err = snd_seq_drain_output (seq);
-    assert (err >= 0);
+    if (running)
+    {
+        g_atomic_int_set (&pending_bpm, bpm);
+
+        if (io_thread == NULL)
+        {
+            playback_poll (get_current_tick ());
+        }
+    }
 }
 
 /**
- * This funtion should be called periodically to handle drum I/O. 
- * Plays the click track if it is set. 
- * Checks for new notes. Any new notes are added to the drumtrack previously
- * set by drum_io_set_drumtrack().
+ * Gets the drum I/O statistics collected since drum_io_init(). May be called
+ * while drum I/O is running.
+ */
+void
+drum_io_get_stats (DrumIoStats *stats)
+{
+    stats->clicks_scheduled = g_atomic_int_get (&n_clicks_scheduled);
+    stats->output_flushes = g_atomic_int_get (&n_output_flushes);
+    stats->pool_full_retries = g_atomic_int_get (&n_pool_full_retries);
+    stats->dropped_notes = g_atomic_int_get (&n_dropped_notes);
+    stats->note_pool_exhausted = g_atomic_int_get (&n_note_pool_exhausted);
+
+    AudioClickStats audio_stats = { 0 };
+    if (audio_click)
+    {
+        audio_click_get_stats (&audio_stats);
+    }
+    stats->late_audio_clicks = audio_stats.late_clicks;
+    stats->audio_xruns = audio_stats.xruns;
+    for (int i = 0; i < DRUM_MAP_N_NOTES; ++i)
+    {
+        stats->unknown_notes[i] = g_atomic_int_get (&unknown_note_counts[i]);
+    }
+}
+
+/**
+ * Returns the current tick of the drum I/O queue.
  */
 guint32
-drum_io_poll (void)
+drum_io_get_current_tick (void)
+{
+    return drum_io_get_fractional_tick ();
+}
+
+/**
+ * Returns the current position of the drum I/O queue in ticks, including the
+ * part of the tick passed. The position is extrapolated from the monotonic
+ * clock and never decreases while running.
+ */
+gdouble
+drum_io_get_fractional_tick (void)
 {
-    while (data_pending ())
+    return drum_io_get_fractional_tick_at (latency_stats_now ());
+}
+
+/**
+ * Returns the position of the drum I/O queue in ticks at time, in us of the
+ * monotonic clock, which may be a time shortly ahead such as when a frame is
+ * shown. Like drum_io_get_fractional_tick() the position never decreases.
+ */
+gdouble
+drum_io_get_fractional_tick_at (gint64 time)
+{
+    if (running)
     {
-        DrumNote *note = get_note ();
-        if (note != NULL)
+        if (io_thread == NULL)
         {
-            if (drumtrack != NULL)
-            {
-                ds_drumtrack_append_note (drumtrack, note);
-            }
-            else
-            {
-                // TODO: This sucks
-                g_free (note);
-            }
+            // Syncs the clock when due
+            poll_queue_clock ();
         }
+        gdouble tick = queue_clock_get_tick (queue_clock, time);
+
+        last_fractional_tick = MAX (tick, last_fractional_tick);
+    }
+
+    return last_fractional_tick;
+}
+
+/**
+ * Creates a main loop source that handles drum I/O when input arrives or it
+ * is time to fill up the click output. New notes are added to the drumtrack
+ * set by drum_io_set_drumtrack() and, unless drum I/O runs in its own thread, the click output is
+ * kept filled. The source callback, if set, is called after that. Only one
+ * source may exist at a time.
+ */
+GSource*
+drum_io_source_new (void)
+{
+    g_assert (g_io_source == NULL);
+
+    GSource *source = g_source_new (&drum_io_source_funcs,
+            sizeof (DrumIoSource));
+    DrumIoSource *io_source = (DrumIoSource *) source;
+
+    io_source->n_seq_fds = snd_seq_poll_descriptors_count (seq, POLLIN);
+    struct pollfd *pfds = g_new (struct pollfd, io_source->n_seq_fds);
+    snd_seq_poll_descriptors (seq, pfds, io_source->n_seq_fds, POLLIN);
+
+    io_source->seq_fds = g_new (GPollFD, io_source->n_seq_fds);
+    for (int i = 0; i < io_source->n_seq_fds; ++i)
+    {
+        io_source->seq_fds[i].fd = pfds[i].fd;
+        io_source->seq_fds[i].events = G_IO_IN | G_IO_ERR;
+        io_source->seq_fds[i].revents = 0;
     }
+    g_free (pfds);
+    io_source->seq_fds_added = FALSE;
+
+    io_source->wakeup_fd.fd = wakeup_fds[0];
+    io_source->wakeup_fd.events = G_IO_IN | G_IO_ERR;
+    io_source->wakeup_fd.revents = 0;
+    g_source_add_poll (source, &io_source->wakeup_fd);
+
+    io_source->next_refill = 0;
 
-    guint32 current_tick = get_current_tick ();
-    playback_poll (current_tick);
+    g_source_set_priority (source, G_PRIORITY_HIGH);
 
-    return current_tick;
+    g_io_source = io_source;
+    set_source_polls_seq (io_thread == NULL);
+
+    return source;
 }
 
 /**
@@ -289,16 +1430,67 @@ drum_io_start (void)
 
     int err;
 
+    // Only the last click track set is left, see drum_io_set_click_track()
+    g_atomic_pointer_set (&pending_click_track, NULL);
+    next_click_track = NULL;
+    g_atomic_pointer_set (&playing_click_track, g_click_track);
     if (g_click_track != NULL)
     {
-        g_cursor = click_track_begin (g_click_track);
+        g_click_track->origin = 0;
+        g_click_track->previous = NULL;
+        g_atomic_int_set (&oldest_used_click_track, g_click_track->seq);
+        seek_cursors (g_click_track->click_track, 0, 0);
+    }
+
+    // Tempo changes after the start are scheduled by playback_poll()
+    if (playback_tempo_map != NULL)
+    {
+        tempo_map_free (playback_tempo_map);
     }
+    playback_tempo_map = tempo_map_copy (g_tempo_map);
+    next_tempo_change = tempo_map_find_change (playback_tempo_map, 1);
+    pending_bpm = 0;
+    change_tempo (tempo_map_get_tempo (playback_tempo_map, 0));
+
+    // The queue restarts from 0, the first poll syncs the clock with it
+    queue_clock_reset (queue_clock);
+    next_clock_sync = 0;
+    last_fractional_tick = 0;
 
     err = snd_seq_start_queue (seq, queue_id, NULL);
     assert (err >= 0);
     err = snd_seq_drain_output (seq);
     assert (err >= 0);
 
+    if (audio_click)
+    {
+        // The queue runs on the monotonic clock from now
+        audio_click_start (latency_stats_now ());
+    }
+
+    if (use_thread)
+    {
+        note_ring_clear (note_ring);
+        thread_quit = FALSE;
+
+        GError *error = NULL;
+        io_thread = g_thread_create (io_thread_func, NULL, TRUE, &error);
+        if (io_thread == NULL)
+        {
+            g_warning ("Could not create I/O thread: %s", error->message);
+            g_error_free (error);
+        }
+        else
+        {
+            set_source_polls_seq (FALSE);
+        }
+    }
+
+    if (g_io_source != NULL)
+    {
+        g_io_source->next_refill = 0;
+    }
+
     running = TRUE;
 }
 
@@ -312,6 +1504,23 @@ drum_io_stop (void)
 
     int err;
 
+    if (io_thread != NULL)
+    {
+        g_atomic_int_set (&thread_quit, TRUE);
+        g_thread_join (io_thread);
+        io_thread = NULL;
+
+        // Hand over any notes still in the ring
+        drain_note_ring ();
+        set_source_polls_seq (TRUE);
+        reclaim_retired (TRUE);
+    }
+
+    if (audio_click)
+    {
+        audio_click_stop ();
+    }
+
     err = snd_seq_stop_queue (seq, queue_id, NULL);
     assert (err >= 0);
     err = snd_seq_drain_output (seq);
@@ -320,5 +1529,38 @@ drum_io_stop (void)
     assert (err >= 0);
 
     running = FALSE;
+
+    g_atomic_pointer_set (&pending_click_track, NULL);
+    g_atomic_pointer_set (&playing_click_track, NULL);
+    next_click_track = NULL;
+    reclaim_click_tracks ();
+}
+
+/**
+ * Returns the click track that plays at tick and sets origin to the tick it
+ * started at. Tick must not be before the current tick by more than a
+ * measure. Returns NULL if there is no click track.
+ */
+ClickTrack *
+drum_io_get_click_track_at (guint32 tick, guint32 *origin)
+{
+    PublishedClickTrack *published = g_click_track;
+    *origin = 0;
+
+    if (running)
+    {
+        published = g_atomic_pointer_get (&playing_click_track);
+        if (published != NULL && tick < published->origin &&
+                published->previous != NULL)
+        {
+            published = published->previous;
+        }
+        if (published != NULL)
+        {
+            *origin = published->origin;
+        }
+    }
+
+    return published != NULL ? published->click_track : NULL;
 }
 
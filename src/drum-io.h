@@ -21,7 +21,9 @@
 #define __DRUM_IO_H__
 
 #include "drum-track.h"
+#include "drum-map.h"
 #include "click-track.h"
+#include "tempo-map.h"
 #include <glib.h>
 
 typedef struct _DrumClick DrumClick;
@@ -30,20 +32,50 @@ struct _DrumClick
 {
     unsigned int tick;
     unsigned int velocity;
+    int channel;
+    int note;
+};
+
+/*
+ * Drum I/O statistics, see drum_io_get_stats().
+ */
+typedef struct _DrumIoStats DrumIoStats;
+
+struct _DrumIoStats
+{
+    guint clicks_scheduled;
+    guint output_flushes;  // Drains of the output buffer
+    guint pool_full_retries;  // Times the sequencer output pool was full
+    guint dropped_notes;  // Notes lost because the note ring was full
+    guint note_pool_exhausted;  // Times a burst filled the note pool
+    guint late_audio_clicks;  // Audio clicks that missed their frame
+    guint audio_xruns;  // Underruns of the audio click PCM
+    guint unknown_notes[DRUM_MAP_N_NOTES];  // Unmapped notes, per note
 };
 
 void drum_io_init (int input_client, int input_port, int output_client,
         int output_port);
-void drum_io_set_midi_to_drum_map ();
+void drum_io_set_midi_to_drum_map (DrumMap *map);
 void drum_io_set_click_to_midi_map ();
 
+void drum_io_set_use_thread (gboolean use_thread);
+void drum_io_set_ppq (unsigned int ppq);
+unsigned int drum_io_get_ppq (void);
+void drum_io_set_real_time_input (gboolean real_time_input);
+gboolean drum_io_set_audio_click (const char *device, GError **error);
 void drum_io_set_drumtrack (DsDrumtrack *new_drumtrack);
 void drum_io_set_click_track (ClickTrack *click_track);
+ClickTrack *drum_io_get_click_track_at (guint32 tick, guint32 *origin);
 void drum_io_set_playback_tempo (int bpm);
+void drum_io_set_tempo_map (TempoMap *tempo_map);
 
 void drum_io_start (void);
 void drum_io_stop (void);
-guint32 drum_io_poll (void);
+guint32 drum_io_get_current_tick (void);
+gdouble drum_io_get_fractional_tick (void);
+gdouble drum_io_get_fractional_tick_at (gint64 time);
+GSource *drum_io_source_new (void);
+void drum_io_get_stats (DrumIoStats *stats);
 
 #endif // __DRUM_IO_H__
 
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "drum-map.h"
+
+#include <string.h>
+
+#define ALL_CHANNELS_GROUP "All channels"
+#define CHANNEL_GROUP_PREFIX "Channel "
+
+struct DrumName_
+{
+    const char *name;
+    DrumType drum;
+};
+
+typedef struct DrumName_ DrumName;
+
+static const DrumName drum_names[] = {
+    { "crash", DRUM_CRASH },
+    { "ride", DRUM_RIDE },
+    { "hihat", DRUM_HIHAT },
+    { "snare", DRUM_SNARE },
+    { "kick", DRUM_KICK } };
+
+struct DefaultMapping_
+{
+    int note;
+    DrumType drum;
+};
+
+typedef struct DefaultMapping_ DefaultMapping;
+
+// General MIDI percussion notes for the drums we show
+static const DefaultMapping default_mappings[] = {
+    { 49, DRUM_CRASH }, { 52, DRUM_CRASH }, { 55, DRUM_CRASH },
+    { 57, DRUM_CRASH },
+    { 51, DRUM_RIDE }, { 53, DRUM_RIDE }, { 59, DRUM_RIDE },
+    { 26, DRUM_HIHAT }, { 42, DRUM_HIHAT }, { 44, DRUM_HIHAT },
+    { 46, DRUM_HIHAT },
+    { 37, DRUM_SNARE }, { 38, DRUM_SNARE }, { 40, DRUM_SNARE },
+    { 35, DRUM_KICK }, { 36, DRUM_KICK } };
+
+/**
+ * Creates a map where all notes are unknown.
+ */
+DrumMap *drum_map_new (void)
+{
+    DrumMap *map = g_malloc (sizeof (DrumMap));
+    memset (map->drums, DRUM_MAP_UNKNOWN, sizeof (map->drums));
+
+    return map;
+}
+
+/**
+ * Creates the built in map, which follows General MIDI on all channels.
+ */
+DrumMap *drum_map_new_default (void)
+{
+    DrumMap *map = drum_map_new ();
+
+    for (unsigned int i = 0; i < G_N_ELEMENTS (default_mappings); ++i)
+    {
+        drum_map_set (map, DRUM_MAP_ALL_CHANNELS, default_mappings[i].note,
+                default_mappings[i].drum);
+    }
+
+    return map;
+}
+
+static int
+parse_channel_group (const char *group)
+{
+    if (strcmp (group, ALL_CHANNELS_GROUP) == 0)
+    {
+        return DRUM_MAP_ALL_CHANNELS;
+    }
+
+    if (!g_str_has_prefix (group, CHANNEL_GROUP_PREFIX))
+    {
+        return DRUM_MAP_N_CHANNELS;
+    }
+
+    char *end;
+    guint64 channel = g_ascii_strtoull (group + strlen (CHANNEL_GROUP_PREFIX),
+            &end, 10);
+    if (*end != '\0' || channel < 1 || channel > DRUM_MAP_N_CHANNELS)
+    {
+        return DRUM_MAP_N_CHANNELS;
+    }
+
+    // Channels are numbered from 1 in kit profiles, as on most kits
+    return channel - 1;
+}
+
+static int
+parse_drum_name (const char *name)
+{
+    for (unsigned int i = 0; i < G_N_ELEMENTS (drum_names); ++i)
+    {
+        if (strcmp (name, drum_names[i].name) == 0)
+        {
+            return drum_names[i].drum;
+        }
+    }
+
+    return DRUM_MAP_UNKNOWN;
+}
+
+/**
+ * Loads a map from a kit profile. A kit profile is a key file with an
+ * "All channels" group and/or "Channel N" groups, N = 1-16. Each key is a
+ * drum name and its value the list of notes that map to it, e.g.
+ *
+ *   [All channels]
+ *   kick=35;36
+ *   snare=38;40
+ *
+ * Channel groups are applied after "All channels". Notes that are not
+ * listed are unknown. Returns NULL and sets error on failure.
+ */
+DrumMap *drum_map_load (const char *filename, GError **error)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    if (!g_key_file_load_from_file (key_file, filename, G_KEY_FILE_NONE,
+                error))
+    {
+        g_key_file_free (key_file);
+        return NULL;
+    }
+
+    DrumMap *map = drum_map_new ();
+    gchar **groups = g_key_file_get_groups (key_file, NULL);
+
+    // Two passes, so that channel groups override "All channels"
+    for (int pass = 0; pass < 2 && map != NULL; ++pass)
+    {
+        for (int i = 0; groups[i] != NULL && map != NULL; ++i)
+        {
+            int channel = parse_channel_group (groups[i]);
+            if (channel == DRUM_MAP_N_CHANNELS)
+            {
+                g_set_error (error, G_KEY_FILE_ERROR,
+                        G_KEY_FILE_ERROR_GROUP_NOT_FOUND,
+                        "Unknown group \"%s\" in %s", groups[i], filename);
+                drum_map_free (map);
+                map = NULL;
+                break;
+            }
+            if ((channel == DRUM_MAP_ALL_CHANNELS) != (pass == 0))
+            {
+                continue;
+            }
+
+            gchar **keys = g_key_file_get_keys (key_file, groups[i], NULL,
+                    NULL);
+            for (int j = 0; keys[j] != NULL && map != NULL; ++j)
+            {
+                int drum = parse_drum_name (keys[j]);
+                gsize n_notes = 0;
+                gint *notes = g_key_file_get_integer_list (key_file,
+                        groups[i], keys[j], &n_notes, error);
+
+                if (drum == DRUM_MAP_UNKNOWN || notes == NULL)
+                {
+                    if (notes != NULL)
+                    {
+                        g_set_error (error, G_KEY_FILE_ERROR,
+                                G_KEY_FILE_ERROR_INVALID_VALUE,
+                                "Unknown drum \"%s\" in %s", keys[j],
+                                filename);
+                    }
+                    drum_map_free (map);
+                    map = NULL;
+                }
+                else
+                {
+                    for (gsize k = 0; k < n_notes; ++k)
+                    {
+                        drum_map_set (map, channel, notes[k], drum);
+                    }
+                }
+
+                g_free (notes);
+            }
+            g_strfreev (keys);
+        }
+    }
+
+    g_strfreev (groups);
+    g_key_file_free (key_file);
+
+    return map;
+}
+
+void drum_map_free (DrumMap *map)
+{
+    g_free (map);
+}
+
+/**
+ * Maps note on channel to drum. Channel may be DRUM_MAP_ALL_CHANNELS and
+ * drum may be DRUM_MAP_UNKNOWN. Notes outside 0-127 are ignored.
+ */
+void drum_map_set (DrumMap *map, int channel, int note, int drum)
+{
+    if (note < 0 || note >= DRUM_MAP_N_NOTES)
+    {
+        return;
+    }
+
+    for (int i = 0; i < DRUM_MAP_N_CHANNELS; ++i)
+    {
+        if (channel == DRUM_MAP_ALL_CHANNELS || channel == i)
+        {
+            map->drums[i][note] = drum;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DRUM_MAP_H__
+#define __DRUM_MAP_H__
+
+#include "drum-track.h"
+#include <glib.h>
+
+#define DRUM_MAP_N_CHANNELS 16
+#define DRUM_MAP_N_NOTES 128
+#define DRUM_MAP_ALL_CHANNELS -1
+#define DRUM_MAP_UNKNOWN -1
+
+/*
+ * Table that maps MIDI channel and note to drum.
+ */
+typedef struct DrumMap_ DrumMap;
+
+struct DrumMap_
+{
+    /* Private */
+    gint8 drums[DRUM_MAP_N_CHANNELS][DRUM_MAP_N_NOTES];
+};
+
+DrumMap *drum_map_new (void);
+DrumMap *drum_map_new_default (void);
+DrumMap *drum_map_load (const char *filename, GError **error);
+void drum_map_free (DrumMap *map);
+
+void drum_map_set (DrumMap *map, int channel, int note, int drum);
+
+/*
+ * Returns the drum for note on channel, or DRUM_MAP_UNKNOWN.
+ */
+static inline int
+drum_map_lookup (const DrumMap *map, int channel, int note)
+{
+    return map->drums[channel & (DRUM_MAP_N_CHANNELS - 1)][
+        note & (DRUM_MAP_N_NOTES - 1)];
+}
+
+#endif // __DRUM_MAP_H__
@@ -26,19 +26,58 @@ G_DEFINE_TYPE (DsDrumtrack, ds_drumtrack, G_TYPE_OBJECT);
 // TODO: Should this be in the class struct?
 static guint drumtrack_signals[NO_OF_SIGNALS];
 
+/*
+ * Notes are stored column wise in fixed size blocks. A block is allocated
+ * once every NOTES_PER_BLOCK notes and is never moved, so appending is
+ * amortized O(1) and a cursor is simply an index into the track.
+ */
+#define NOTES_PER_BLOCK_SHIFT 10
+#define NOTES_PER_BLOCK (1 << NOTES_PER_BLOCK_SHIFT)
+#define BLOCK_INDEX_MASK (NOTES_PER_BLOCK - 1)
+
+typedef struct _DrumNoteBlock DrumNoteBlock;
+
+struct _DrumNoteBlock
+{
+    guint32 tick[NOTES_PER_BLOCK];
+    gfloat tick_fraction[NOTES_PER_BLOCK];
+    gint32 velocity[NOTES_PER_BLOCK];
+    guint8 drum[NOTES_PER_BLOCK];
+    gint64 arrival_time[NOTES_PER_BLOCK];
+};
+
+static inline DrumNoteBlock*
+get_block (DsDrumtrack *drumtrack, guint index)
+{
+    return g_ptr_array_index (drumtrack->blocks,
+            index >> NOTES_PER_BLOCK_SHIFT);
+}
+
+static void
+emit_changed (DsDrumtrack *drumtrack, guint first_index, guint n_notes)
+{
+    DrumNoteBlock *first_block = get_block (drumtrack, first_index);
+    guint last_index = first_index + n_notes - 1;
+    DrumNoteBlock *last_block = get_block (drumtrack, last_index);
+
+    DrumTrackRange range = { first_index: first_index, n_notes: n_notes,
+        start_tick: first_block->tick[first_index & BLOCK_INDEX_MASK],
+        end_tick: last_block->tick[last_index & BLOCK_INDEX_MASK] };
+
+    g_signal_emit (drumtrack, drumtrack_signals[CHANGED_SIGNAL], 0, &range);
+}
+
 static void
 ds_drumtrack_finalize (GObject *object)
 {
     DsDrumtrack *drumtrack = DS_DRUMTRACK (object);
 
-    GList *node = drumtrack->notes->head;
-    while (node != NULL)
+    for (guint i = 0; i < drumtrack->blocks->len; ++i)
     {
-        g_free (node->data);
-        node = node->next;
+        g_free (g_ptr_array_index (drumtrack->blocks, i));
     }
 
-    g_queue_free (drumtrack->notes);
+    g_ptr_array_free (drumtrack->blocks, TRUE);
 
     // Chain up
     G_OBJECT_CLASS (ds_drumtrack_parent_class)->finalize (object);
@@ -47,7 +86,10 @@ ds_drumtrack_finalize (GObject *object)
 static void
 ds_drumtrack_init (DsDrumtrack *object)
 {
-    object->notes = g_queue_new ();
+    object->blocks = g_ptr_array_new ();
+    object->n_notes = 0;
+    object->freeze_count = 0;
+    object->n_pending = 0;
 }
 
 static void
@@ -57,16 +99,18 @@ ds_drumtrack_class_init (DsDrumtrackClass *klass)
 
     gobject_class->finalize = ds_drumtrack_finalize;
 
+    // The parameter is a const DrumTrackRange* with the appended notes
+    GType changed_param_types[] = { G_TYPE_POINTER };
     drumtrack_signals[CHANGED_SIGNAL] = g_signal_newv ("changed",
             G_TYPE_FROM_CLASS (gobject_class),
             G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
             NULL,
             NULL,
             NULL,
-            g_cclosure_marshal_VOID__VOID,
+            g_cclosure_marshal_VOID__POINTER,
             G_TYPE_NONE,
-            0,
-            NULL);
+            1,
+            changed_param_types);
 }
 
 
@@ -80,21 +124,108 @@ ds_drumtrack_new (void)
 }
 
 /**
- * Appends a note to the drumtrack. The drumtrack takes ownership of the note.
+ * Appends a note to the drumtrack. The note is copied into the track.
  * Emits "changed" signal.
  */
 void
-ds_drumtrack_append_note (DsDrumtrack *drumtrack, DrumNote *note)
+ds_drumtrack_append_note (DsDrumtrack *drumtrack, const DrumNote *note)
 {
-    DrumNote *prev_note = g_queue_peek_tail (drumtrack->notes);
-    if (prev_note != NULL)
+    ds_drumtrack_append_notes (drumtrack, note, 1);
+}
+
+/**
+ * Appends n_notes notes, in increasing tick order, to the drumtrack. The
+ * notes are copied into the track. Emits one "changed" signal for all of
+ * the notes.
+ */
+void
+ds_drumtrack_append_notes (DsDrumtrack *drumtrack, const DrumNote *notes,
+        guint n_notes)
+{
+    if (n_notes == 0)
     {
-        g_assert (prev_note->tick <= note->tick);
+        return;
+    }
+
+    guint first_index = drumtrack->n_notes;
+    guint32 prev_tick = 0;
+    if (first_index > 0)
+    {
+        DrumNoteBlock *last_block = get_block (drumtrack, first_index - 1);
+        prev_tick = last_block->tick[(first_index - 1) & BLOCK_INDEX_MASK];
+    }
+
+    for (guint i = 0; i < n_notes; ++i)
+    {
+        guint index = first_index + i;
+        g_assert (prev_tick <= notes[i].tick);
+
+        if ((index & BLOCK_INDEX_MASK) == 0)
+        {
+            g_ptr_array_add (drumtrack->blocks, g_new (DrumNoteBlock, 1));
+        }
+
+        DrumNoteBlock *block = get_block (drumtrack, index);
+        guint offset = index & BLOCK_INDEX_MASK;
+        block->tick[offset] = notes[i].tick;
+        block->tick_fraction[offset] = notes[i].tick_fraction;
+        block->velocity[offset] = notes[i].velocity;
+        block->drum[offset] = notes[i].drum;
+        block->arrival_time[offset] = notes[i].arrival_time;
+
+        prev_tick = notes[i].tick;
     }
 
-    g_queue_push_tail (drumtrack->notes, note);
+    drumtrack->n_notes = first_index + n_notes;
 
-    g_signal_emit (drumtrack, drumtrack_signals[CHANGED_SIGNAL], 0);
+    if (drumtrack->freeze_count > 0)
+    {
+        drumtrack->n_pending += n_notes;
+    }
+    else
+    {
+        emit_changed (drumtrack, first_index, n_notes);
+    }
+}
+
+/**
+ * Stops emission of "changed" until ds_drumtrack_thaw_changed() is called.
+ * Calls may be nested.
+ */
+void
+ds_drumtrack_freeze_changed (DsDrumtrack *drumtrack)
+{
+    drumtrack->freeze_count++;
+}
+
+/**
+ * Reverts the effect of a previous call to ds_drumtrack_freeze_changed().
+ * If notes were appended while frozen, "changed" is emitted once with all
+ * of them when the last freeze is reverted.
+ */
+void
+ds_drumtrack_thaw_changed (DsDrumtrack *drumtrack)
+{
+    g_assert (drumtrack->freeze_count > 0);
+
+    drumtrack->freeze_count--;
+
+    if (drumtrack->freeze_count == 0 && drumtrack->n_pending > 0)
+    {
+        guint n_pending = drumtrack->n_pending;
+        drumtrack->n_pending = 0;
+
+        emit_changed (drumtrack, drumtrack->n_notes - n_pending, n_pending);
+    }
+}
+
+/**
+ * Returns the number of notes in the track.
+ */
+guint
+ds_drumtrack_get_n_notes (DsDrumtrack *drumtrack)
+{
+    return drumtrack->n_notes;
 }
 
 /**
@@ -103,7 +234,77 @@ ds_drumtrack_append_note (DsDrumtrack *drumtrack, DrumNote *note)
 DrumTrackCursor
 ds_drumtrack_begin (DsDrumtrack *drumtrack)
 {
-    DrumTrackCursor cursor = { current_note: drumtrack->notes->head };
+    DrumTrackCursor cursor = { drumtrack: drumtrack, index: 0 };
+
+    return cursor;
+}
+
+/**
+ * Returns a cursor to the first note with a tick greater than or equal to
+ * tick, or the end of the track if there is no such note. Takes O(log n)
+ * time: the first tick of each block is used as a sparse index to find the
+ * block, which is then searched.
+ */
+DrumTrackCursor
+ds_drumtrack_seek (DsDrumtrack *drumtrack, guint32 tick)
+{
+    // Find the first block starting at or after tick
+    guint low = 0;
+    guint high = drumtrack->blocks->len;
+    while (low < high)
+    {
+        guint middle = low + (high - low) / 2;
+        DrumNoteBlock *block = g_ptr_array_index (drumtrack->blocks, middle);
+        if (block->tick[0] < tick)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    DrumTrackCursor cursor = { drumtrack: drumtrack, index: 0 };
+    if (low == 0)
+    {
+        return cursor;
+    }
+
+    // The note is in the previous block or, if all of its notes are before
+    // tick, first in the block found above.
+    guint block_start = (low - 1) << NOTES_PER_BLOCK_SHIFT;
+    DrumNoteBlock *block = g_ptr_array_index (drumtrack->blocks, low - 1);
+    low = 0;
+    high = MIN (drumtrack->n_notes - block_start, NOTES_PER_BLOCK);
+    while (low < high)
+    {
+        guint middle = low + (high - low) / 2;
+        if (block->tick[middle] < tick)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    cursor.index = block_start + low;
+
+    return cursor;
+}
+
+/**
+ * Returns a cursor to the note at index, or the end of the track if index is
+ * the number of notes.
+ */
+DrumTrackCursor
+ds_drumtrack_cursor_at (DsDrumtrack *drumtrack, guint index)
+{
+    g_assert (index <= drumtrack->n_notes);
+
+    DrumTrackCursor cursor = { drumtrack: drumtrack, index: index };
 
     return cursor;
 }
@@ -114,31 +315,110 @@ ds_drumtrack_begin (DsDrumtrack *drumtrack)
 DrumTrackCursor
 ds_drumtrack_cursor_next (DrumTrackCursor cursor)
 {
-    g_assert (cursor.current_note != NULL);
+    g_assert (cursor.index < cursor.drumtrack->n_notes);
 
-    DrumTrackCursor new_cursor = { current_note: cursor.current_note->next };
+    DrumTrackCursor new_cursor = { drumtrack: cursor.drumtrack,
+        index: cursor.index + 1 };
 
     return new_cursor;
 }
 
 /**
  * Returns true if the cursor is at the end of the track. The end is one
- * note past the last note and is not valid to dereference.
+ * note past the last note and is not valid to dereference. Notes appended
+ * after the cursor reached the end makes it valid again.
  */
 gboolean
 ds_drumtrack_cursor_at_end (DrumTrackCursor cursor)
 {
-    return cursor.current_note == NULL;
+    return cursor.index >= cursor.drumtrack->n_notes;
 }
 
 /**
- * Returns the note that the cursor points at.
+ * Returns the index of the note that the cursor points at. The first note
+ * of the track has index 0.
  */
-DrumNote*
+guint
+ds_drumtrack_cursor_index (DrumTrackCursor cursor)
+{
+    return cursor.index;
+}
+
+/**
+ * Returns a copy of the note that the cursor points at.
+ */
+DrumNote
 ds_drumtrack_cursor_data (DrumTrackCursor cursor)
 {
-    g_assert (cursor.current_note != NULL);
+    DrumNote note = { tick: ds_drumtrack_cursor_tick (cursor),
+        tick_fraction: get_block (cursor.drumtrack, cursor.index)->
+            tick_fraction[cursor.index & BLOCK_INDEX_MASK],
+        velocity: ds_drumtrack_cursor_velocity (cursor),
+        drum: ds_drumtrack_cursor_drum (cursor),
+        arrival_time: ds_drumtrack_cursor_arrival_time (cursor) };
+
+    return note;
+}
+
+/**
+ * Returns the tick of the note that the cursor points at.
+ */
+guint32
+ds_drumtrack_cursor_tick (DrumTrackCursor cursor)
+{
+    g_assert (cursor.index < cursor.drumtrack->n_notes);
 
-    return cursor.current_note->data;
+    return get_block (cursor.drumtrack, cursor.index)->tick[
+        cursor.index & BLOCK_INDEX_MASK];
 }
 
+/**
+ * Returns the tick of the note that the cursor points at, including the part
+ * of the tick passed.
+ */
+gdouble
+ds_drumtrack_cursor_fractional_tick (DrumTrackCursor cursor)
+{
+    g_assert (cursor.index < cursor.drumtrack->n_notes);
+
+    const DrumNoteBlock *block = get_block (cursor.drumtrack, cursor.index);
+    guint offset = cursor.index & BLOCK_INDEX_MASK;
+
+    return block->tick[offset] + block->tick_fraction[offset];
+}
+
+/**
+ * Returns the velocity of the note that the cursor points at.
+ */
+gint32
+ds_drumtrack_cursor_velocity (DrumTrackCursor cursor)
+{
+    g_assert (cursor.index < cursor.drumtrack->n_notes);
+
+    return get_block (cursor.drumtrack, cursor.index)->velocity[
+        cursor.index & BLOCK_INDEX_MASK];
+}
+
+/**
+ * Returns the drum of the note that the cursor points at.
+ */
+DrumType
+ds_drumtrack_cursor_drum (DrumTrackCursor cursor)
+{
+    g_assert (cursor.index < cursor.drumtrack->n_notes);
+
+    return get_block (cursor.drumtrack, cursor.index)->drum[
+        cursor.index & BLOCK_INDEX_MASK];
+}
+
+/**
+ * Returns the arrival time of the note that the cursor points at.
+ */
+gint64
+ds_drumtrack_cursor_arrival_time (DrumTrackCursor cursor)
+{
+    g_assert (cursor.index < cursor.drumtrack->n_notes);
+
+    return get_block (cursor.drumtrack, cursor.index)->arrival_time[
+        cursor.index & BLOCK_INDEX_MASK];
+}
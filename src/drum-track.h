@@ -47,7 +47,11 @@ struct _DsDrumtrack
     GObject parent_instance;
 
     /*< private >*/
-    GQueue *notes;
+    GPtrArray *blocks;  // Note storage, see drum-track.c
+    guint n_notes;
+
+    gint freeze_count;
+    guint n_pending;  // Notes appended while frozen
 };
 
 struct _DsDrumtrackClass
@@ -68,27 +72,55 @@ typedef enum _DrumType DrumType;
 struct _DrumNote
 {
     guint32 tick;
+    gfloat tick_fraction;  // Part of the tick passed, 0 unless known
     gint32 velocity;
     DrumType drum;
+    gint64 arrival_time;  // us, monotonic clock time when the note was read
 };
 typedef struct _DrumNote DrumNote;
 
+/*
+ * Range of notes appended to a track. Passed to "changed" handlers.
+ */
+struct _DrumTrackRange
+{
+    guint first_index;
+    guint n_notes;
+    guint32 start_tick;  // Tick of the first note in the range
+    guint32 end_tick;  // Tick of the last note in the range
+};
+typedef struct _DrumTrackRange DrumTrackRange;
+
 struct _DrumTrackCursor
 {
     /* Private */
-    GList *current_note;
+    DsDrumtrack *drumtrack;
+    guint index;
 };
 typedef struct _DrumTrackCursor DrumTrackCursor;
 
 GType ds_drumtrack_get_type (void) G_GNUC_CONST;
 
 DsDrumtrack *ds_drumtrack_new (void);
-void ds_drumtrack_append_note (DsDrumtrack *drum_track, DrumNote *note);
+void ds_drumtrack_append_note (DsDrumtrack *drum_track, const DrumNote *note);
+void ds_drumtrack_append_notes (DsDrumtrack *drum_track, const DrumNote *notes,
+        guint n_notes);
+void ds_drumtrack_freeze_changed (DsDrumtrack *drum_track);
+void ds_drumtrack_thaw_changed (DsDrumtrack *drum_track);
+guint ds_drumtrack_get_n_notes (DsDrumtrack *drum_track);
 
 DrumTrackCursor ds_drumtrack_begin (DsDrumtrack *drum_track);
+DrumTrackCursor ds_drumtrack_seek (DsDrumtrack *drum_track, guint32 tick);
+DrumTrackCursor ds_drumtrack_cursor_at (DsDrumtrack *drum_track, guint index);
 DrumTrackCursor ds_drumtrack_cursor_next (DrumTrackCursor cursor);
 gboolean ds_drumtrack_cursor_at_end (DrumTrackCursor cursor);
-DrumNote *ds_drumtrack_cursor_data (DrumTrackCursor cursor);
+guint ds_drumtrack_cursor_index (DrumTrackCursor cursor);
+DrumNote ds_drumtrack_cursor_data (DrumTrackCursor cursor);
+guint32 ds_drumtrack_cursor_tick (DrumTrackCursor cursor);
+gdouble ds_drumtrack_cursor_fractional_tick (DrumTrackCursor cursor);
+gint32 ds_drumtrack_cursor_velocity (DrumTrackCursor cursor);
+DrumType ds_drumtrack_cursor_drum (DrumTrackCursor cursor);
+gint64 ds_drumtrack_cursor_arrival_time (DrumTrackCursor cursor);
 
 G_END_DECLS
 
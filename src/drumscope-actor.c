@@ -18,9 +18,12 @@
  */
 
 #include "drumscope-actor.h"
+#include "latency-stats.h"
 
 #include <clutter/clutter.h>
 #include <cogl/cogl.h>
+#include <math.h>
+#include <string.h>
 
 G_DEFINE_TYPE (DsDrumscope, ds_drumscope, CLUTTER_TYPE_ACTOR);
 
@@ -29,26 +32,63 @@ G_DEFINE_TYPE (DsDrumscope, ds_drumscope, CLUTTER_TYPE_ACTOR);
     DS_TYPE_DRUMSCOPE, DsDrumscopePrivate))
 
 #define NR_OF_NOTE_LINES 5
-#define CURSOR_MARGIN 48
+#define CURSOR_MARGIN 0.5  // Beats
 #define LABEL_MARGIN 10
 #define SCOPE_MARGIN 2
+#define N_LAYER_COLORS 3
+#define MIN_SCENE_VERTICES 1024
+#define SCROLL_VIEWS 2  // Views of the scope texture when scrolling
 
 const char * const LABELS[NR_OF_NOTE_LINES] = {"C", "R", "H", "S", "K"};
 
+const guint8 LINE_COLOR[3] = { 0x80, 0x80, 0xff };
+const guint8 NOTE_COLOR[3] = { 0xff, 0xff, 0xff };
+
+// Bar colors of the polyrhythm layers
+const guint8 LAYER_COLORS[N_LAYER_COLORS][3] = {
+    { 0xff, 0xa0, 0x40 }, { 0xff, 0x60, 0xc0 }, { 0x40, 0xd0, 0xd0 } };
+
+typedef struct _SceneVertex SceneVertex;
+
+struct _SceneVertex
+{
+    float x;
+    float y;
+    guint8 color[4];
+};
+
+/*
+ * Coloured rectangles drawn with one vertex buffer draw. The buffer is kept
+ * and only replaced when the batch outgrows it.
+ */
+typedef struct _SceneBatch SceneBatch;
+
+struct _SceneBatch
+{
+    GArray *vertices;
+    guint n_vertices;
+    CoglHandle buffer;
+    guint buffer_size;
+};
+
 struct _DsDrumscopePrivate
 {
-    guint32 cursor_tick;
+    gdouble cursor_tick;  // Including the part of the tick passed
 
     gboolean continous_scroll;
     guint32 visible_ticks;
     unsigned int n_visible_measures;
     guint32 cursor_margin;
+    guint32 scroll_ticks;  // Visible ticks when scrolling continuously
+    gdouble view_start_tick;  // First visible tick, start_tick unless scrolling
 
     /* weak reference */
     DsDrumtrack *drumtrack;
-    DrumTrackCursor first_visible_note;
+    gulong drumtrack_changed_id;
+    guint first_unpainted_note;  // Index of the first note not yet drawn
 
-    ClickTrack *click_track;  // TODO: Weak reference
+    ClickTrack *click_track;
+    guint32 click_origin;  // Tick the click track starts at
     ClickTrackCursor first_visible_click;
 
     ClutterActor *labels[NR_OF_NOTE_LINES];
@@ -56,8 +96,30 @@ struct _DsDrumscopePrivate
     // Cached values
     int note_lines_ycoord[NR_OF_NOTE_LINES];
     int max_label_width;
-    guint32 start_tick;
-    guint32 stop_tick;
+    guint32 start_tick;  // Range drawn to the scope texture, the page or
+    guint32 stop_tick;  // SCROLL_VIEWS views when scrolling continuously
+
+    // The scope texture accumulates the labels, lines and click bars of the
+    // range with the notes drawn so far. Only notes that arrived since the
+    // last frame are drawn to it, and scrolling only moves the part of it
+    // shown. Without offscreen support the batches are drawn each frame.
+    CoglHandle scope_texture;
+    CoglHandle scope_fbo;
+    guint texture_width;
+    guint texture_height;
+    SceneBatch background;
+    gboolean background_dirty;
+    SceneBatch notes;  // Visible notes, only used without the texture
+    GArray *note_rectangles;  // x1, y1, x2, y2 of notes to draw to it
+    gboolean notes_dirty;  // Draw all visible notes again
+    gboolean new_notes;  // Visible notes arrived
+    guint first_undrawn_note;  // Index of the first note not in the scene
+
+    // Visible range and size the scene was built for
+    guint32 scene_start_tick;
+    guint32 scene_stop_tick;
+    guint scene_width;
+    guint scene_height;
 };
 
 static void
@@ -88,117 +150,456 @@ ds_drumscope_allocate (ClutterActor *actor,
 
     // TODO: This should not be hardcoded
     priv->max_label_width = 20;
+    priv->background_dirty = TRUE;
+    priv->notes_dirty = TRUE;
 
     // Chain up
     CLUTTER_ACTOR_CLASS (ds_drumscope_parent_class)->allocate (
             actor, box, flags);
 }
 
+/*
+ * Returns a cursor to the first click of layer at or after tick, which is
+ * relative to the start of the drumscope rather than the click track.
+ */
+static ClickTrackCursor
+seek_click (DsDrumscopePrivate *priv, guint layer, guint32 tick)
+{
+    tick = MAX (tick, priv->click_origin) - priv->click_origin;
+
+    return click_track_cursor_shift (click_track_layer_seek (priv->click_track,
+                layer, tick), priv->click_origin);
+}
+
 static void
-ds_drumscope_paint (ClutterActor *actor)
+scene_batch_init (SceneBatch *batch)
 {
-    DsDrumscope *drumscope = DS_DRUMSCOPE (actor);
-    DsDrumscopePrivate *priv = drumscope->priv;
+    batch->vertices = g_array_new (FALSE, TRUE, sizeof (SceneVertex));
+    batch->n_vertices = 0;
+    batch->buffer = COGL_INVALID_HANDLE;
+    batch->buffer_size = 0;
+}
+
+static void
+scene_batch_release (SceneBatch *batch)
+{
+    if (batch->buffer != COGL_INVALID_HANDLE)
+    {
+        cogl_handle_unref (batch->buffer);
+        batch->buffer = COGL_INVALID_HANDLE;
+        batch->buffer_size = 0;
+    }
+}
+
+static void
+scene_batch_free (SceneBatch *batch)
+{
+    scene_batch_release (batch);
+    g_array_free (batch->vertices, TRUE);
+}
+
+static void
+scene_batch_clear (SceneBatch *batch)
+{
+    g_array_set_size (batch->vertices, 0);
+}
+
+/*
+ * Adds a rectangle as two triangles to the batch.
+ */
+static void
+scene_batch_add_rectangle (SceneBatch *batch, float x1, float y1, float x2,
+        float y2, const guint8 *rgb)
+{
+    SceneVertex corners[6] = {
+        { x: x1, y: y1 }, { x: x2, y: y1 }, { x: x1, y: y2 },
+        { x: x1, y: y2 }, { x: x2, y: y1 }, { x: x2, y: y2 } };
+
+    for (int i = 0; i < 6; ++i)
+    {
+        memcpy (corners[i].color, rgb, 3);
+        corners[i].color[3] = 0xff;
+    }
+
+    g_array_append_vals (batch->vertices, corners, 6);
+}
+
+/*
+ * Uploads the rectangles added since the batch was cleared.
+ */
+static void
+scene_batch_submit (SceneBatch *batch)
+{
+    GArray *vertices = batch->vertices;
+    batch->n_vertices = vertices->len;
+
+    if (batch->buffer == COGL_INVALID_HANDLE ||
+            batch->n_vertices > batch->buffer_size)
+    {
+        guint size = MAX (MIN_SCENE_VERTICES,
+                MAX (batch->n_vertices, 2 * batch->buffer_size));
+        scene_batch_release (batch);
+        batch->buffer = cogl_vertex_buffer_new (size);
+        batch->buffer_size = size;
+    }
+
+    // The unused tail of the buffer is uploaded as cleared vertices, and
+    // cut off again below so that later rectangles are added after the
+    // real ones
+    g_array_set_size (vertices, batch->buffer_size);
+
+    SceneVertex *first = &g_array_index (vertices, SceneVertex, 0);
+    cogl_vertex_buffer_add (batch->buffer, "gl_Vertex", 2,
+            COGL_ATTRIBUTE_TYPE_FLOAT, FALSE, sizeof (SceneVertex),
+            &first->x);
+    cogl_vertex_buffer_add (batch->buffer, "gl_Color", 4,
+            COGL_ATTRIBUTE_TYPE_UNSIGNED_BYTE, TRUE, sizeof (SceneVertex),
+            first->color);
+    cogl_vertex_buffer_submit (batch->buffer);
+
+    g_array_set_size (vertices, batch->n_vertices);
+}
+
+static void
+scene_batch_draw (SceneBatch *batch)
+{
+    if (batch->n_vertices > 0)
+    {
+        cogl_vertex_buffer_draw (batch->buffer, GL_TRIANGLES, 0,
+                batch->n_vertices);
+    }
+}
+
+/*
+ * Adds the bars of the visible clicks of layer to the background.
+ */
+static void
+add_click_bars (DsDrumscopePrivate *priv, guint layer, int scope_x,
+        float x_factor, float height, const guint8 *rgb)
+{
+    ClickTrackCursor current_click = layer == 0 ? priv->first_visible_click :
+        seek_click (priv, layer, priv->start_tick);
+    int measure_bar_width = layer == 0 ? 3 : 2;
+
+    while (click_track_cursor_tick (current_click) < priv->stop_tick)
+    {
+        int rel_tick = click_track_cursor_tick (current_click) -
+            priv->start_tick;
+        int bar_x = scope_x + rel_tick * x_factor;
+        int bar_width = 1;
+        if (click_track_cursor_bar_type (current_click) == BAR_MEASURE_START)
+        {
+            bar_width = measure_bar_width;
+        }
+        scene_batch_add_rectangle (&priv->background, bar_x, 0,
+                bar_x + bar_width, height, rgb);
+
+        current_click = click_track_cursor_next_click (current_click);
+    }
+}
 
+static void
+paint_labels (DsDrumscopePrivate *priv)
+{
     for (int i = 0; i < NR_OF_NOTE_LINES; ++i)
     {
-        ClutterActor *child = priv->labels[i];
-        clutter_actor_paint (child);
+        clutter_actor_paint (priv->labels[i]);
     }
+}
 
-    ClutterGeometry geom;
-    clutter_actor_get_geometry (actor, &geom);
-    //printf ("Width: %d Height: %d\n", geom.width, geom.height);
+/*
+ * Returns the pixels per tick of the scope.
+ */
+static float
+get_x_factor (DsDrumscopePrivate *priv, const ClutterGeometry *geom)
+{
+    int scope_x = priv->max_label_width + LABEL_MARGIN;
+    float scope_width = geom->width - scope_x - SCOPE_MARGIN;
+
+    return scope_width / priv->visible_ticks;
+}
+
+/*
+ * Returns the width of the range drawn to the scope texture, with the labels
+ * and margins.
+ */
+static guint
+get_range_width (DsDrumscopePrivate *priv, const ClutterGeometry *geom)
+{
+    int scope_x = priv->max_label_width + LABEL_MARGIN;
+
+    return scope_x + SCOPE_MARGIN + ceil ((priv->stop_tick -
+                priv->start_tick) * get_x_factor (priv, geom));
+}
+
+/*
+ * Makes the scope texture width by height, and an offscreen buffer to
+ * render to it. Returns FALSE if offscreen rendering is not supported.
+ */
+static gboolean
+ensure_scope_texture (DsDrumscopePrivate *priv, guint width, guint height)
+{
+    if (priv->scope_fbo != COGL_INVALID_HANDLE &&
+            priv->texture_width == width && priv->texture_height == height)
+    {
+        return TRUE;
+    }
+
+    if (priv->scope_fbo != COGL_INVALID_HANDLE)
+    {
+        cogl_handle_unref (priv->scope_fbo);
+        priv->scope_fbo = COGL_INVALID_HANDLE;
+    }
+    if (priv->scope_texture != COGL_INVALID_HANDLE)
+    {
+        cogl_handle_unref (priv->scope_texture);
+        priv->scope_texture = COGL_INVALID_HANDLE;
+    }
+
+    if (!cogl_features_available (COGL_FEATURE_OFFSCREEN) ||
+            width == 0 || height == 0)
+    {
+        return FALSE;
+    }
+
+    priv->scope_texture = cogl_texture_new_with_size (width, height,
+            COGL_TEXTURE_NONE, COGL_PIXEL_FORMAT_RGBA_8888_PRE);
+    if (priv->scope_texture != COGL_INVALID_HANDLE)
+    {
+        priv->scope_fbo = cogl_offscreen_new_to_texture (
+                priv->scope_texture);
+    }
+
+    if (priv->scope_fbo == COGL_INVALID_HANDLE)
+    {
+        if (priv->scope_texture != COGL_INVALID_HANDLE)
+        {
+            cogl_handle_unref (priv->scope_texture);
+            priv->scope_texture = COGL_INVALID_HANDLE;
+        }
+        return FALSE;
+    }
+    priv->texture_width = width;
+    priv->texture_height = height;
+
+    return TRUE;
+}
 
+/*
+ * Rebuilds the note lines and click bars of the range, and renders them with
+ * the labels to the scope texture. The notes must be drawn again.
+ */
+static void
+update_background (DsDrumscopePrivate *priv, const ClutterGeometry *geom)
+{
     int scope_x = priv->max_label_width + LABEL_MARGIN;
-    float scope_width = geom.width - scope_x - SCOPE_MARGIN;
-    float x_factor = scope_width / priv->visible_ticks;
+    float x_factor = get_x_factor (priv, geom);
+    guint width = get_range_width (priv, geom);
 
-    CoglColor color;
-    cogl_color_set_from_4ub (&color, 0x80, 0x80, 0xff, 0xff);
-    cogl_set_source_color (&color);
+    scene_batch_clear (&priv->background);
 
-    // Draw lines
     for (int i = 0; i < NR_OF_NOTE_LINES; ++i)
     {
         int current_y = priv->note_lines_ycoord[i];
-        cogl_rectangle (scope_x, current_y, geom.width - SCOPE_MARGIN,
-                current_y + 1);
+        scene_batch_add_rectangle (&priv->background, scope_x, current_y,
+                width - SCOPE_MARGIN, current_y + 1, LINE_COLOR);
     }
 
-    // Draw click track bars
     if (priv->click_track != NULL)
     {
-        ClickTrackCursor current_click = priv->first_visible_click;
+        add_click_bars (priv, 0, scope_x, x_factor, geom->height,
+                LINE_COLOR);
 
-        while (click_track_cursor_tick (current_click) < priv->stop_tick)
+        // Polyrhythm layers
+        guint n_layers = click_track_get_n_layers (priv->click_track);
+        for (guint layer = 1; layer < n_layers; ++layer)
         {
-            int rel_tick = click_track_cursor_tick (current_click) -
-                priv->start_tick;
-            int bar_x = scope_x + rel_tick * x_factor;
-            int bar_width = 1;
-            if (click_track_cursor_bar_type (current_click) ==
-                    BAR_MEASURE_START)
-            {
-                bar_width = 3;
-            }
-            cogl_rectangle (bar_x, 0, bar_x + bar_width, geom.height);
-
-            current_click = click_track_cursor_next_click (current_click);
+            add_click_bars (priv, layer, scope_x, x_factor, geom->height,
+                    LAYER_COLORS[(layer - 1) % N_LAYER_COLORS]);
         }
     }
 
-    // Draw cursor
-    CoglColor cursor_color;
-    cogl_color_set_from_4ub (&cursor_color, 0x80, 0xff, 0x80, 0xff);
-    cogl_set_source_color (&cursor_color);
-    int cursor_x = scope_x + (priv->cursor_tick - priv->start_tick) * x_factor;
-    cogl_rectangle (cursor_x, 0, cursor_x + 1, geom.height);
+    scene_batch_submit (&priv->background);
 
-    // Draw notes
-    CoglColor note_color;
-    cogl_color_set_from_4ub (&note_color, 0xff, 0xff, 0xff, 0xff);
-    cogl_set_source_color (&note_color);
+    if (ensure_scope_texture (priv, width, geom->height))
+    {
+        // Offscreen drawing is in pixels of the texture
+        CoglColor transparent;
+        cogl_color_set_from_4ub (&transparent, 0, 0, 0, 0);
+
+        cogl_set_draw_buffer (COGL_OFFSCREEN_BUFFER, priv->scope_fbo);
+        cogl_clear (&transparent, COGL_BUFFER_BIT_COLOR);
+        paint_labels (priv);
+        scene_batch_draw (&priv->background);
+        cogl_set_draw_buffer (COGL_WINDOW_BUFFER, COGL_INVALID_HANDLE);
+    }
+
+    priv->background_dirty = FALSE;
+    priv->notes_dirty = TRUE;
+}
+
+/*
+ * Draws the notes not yet in the scene, or all visible notes if they must be
+ * drawn again. With the scope texture the notes are drawn to it at once, in
+ * one call for all of them, so only the new notes cost anything. Otherwise
+ * they are added to the notes batch.
+ */
+static void
+update_notes (DsDrumscopePrivate *priv, const ClutterGeometry *geom)
+{
+    int scope_x = priv->max_label_width + LABEL_MARGIN;
+    float x_factor = get_x_factor (priv, geom);
+    gboolean layered = priv->scope_fbo != COGL_INVALID_HANDLE;
+
+    g_array_set_size (priv->note_rectangles, 0);
+    if (priv->notes_dirty)
+    {
+        scene_batch_clear (&priv->notes);
+    }
 
     if (priv->drumtrack != NULL)
     {
-        // Start from beginning of drum track if we have reached the end.
-        DrumTrackCursor cursor = priv->first_visible_note;
-        if (ds_drumtrack_cursor_at_end (cursor))
-        {
-            cursor = ds_drumtrack_begin (priv->drumtrack);
-        }
+        gint64 paint_time = latency_stats_now ();
+        DrumTrackCursor cursor = priv->notes_dirty ?
+            ds_drumtrack_seek (priv->drumtrack, priv->start_tick) :
+            ds_drumtrack_cursor_at (priv->drumtrack,
+                    priv->first_undrawn_note);
 
-        // Find the first visible note and save the cursor
         while (!ds_drumtrack_cursor_at_end (cursor))
         {
-            DrumNote *note = ds_drumtrack_cursor_data (cursor);
-            if (note->tick >= priv->start_tick)
+            gdouble tick = ds_drumtrack_cursor_fractional_tick (cursor);
+
+            if (tick >= priv->stop_tick)
             {
                 break;
             }
-            cursor = ds_drumtrack_cursor_next (cursor);
-        }
-        priv->first_visible_note = cursor;
 
-        while (!ds_drumtrack_cursor_at_end (cursor))
-        {
-            DrumNote *note = ds_drumtrack_cursor_data (cursor);
-
-            if (note->tick >= priv->stop_tick)
+            if (tick >= priv->start_tick)
             {
-                break;
+                float current_x = scope_x +
+                    (tick - priv->start_tick) * x_factor;
+                int current_y = priv->note_lines_ycoord[
+                    ds_drumtrack_cursor_drum (cursor)];
+                float rectangle[4] = { current_x - 4, current_y - 4,
+                    current_x + 5, current_y + 5 };
+
+                if (layered)
+                {
+                    g_array_append_vals (priv->note_rectangles, rectangle, 4);
+                }
+                else
+                {
+                    scene_batch_add_rectangle (&priv->notes, rectangle[0],
+                            rectangle[1], rectangle[2], rectangle[3],
+                            NOTE_COLOR);
+                }
+
+                // Notes that scroll by before they are drawn are not counted
+                guint index = ds_drumtrack_cursor_index (cursor);
+                if (index >= priv->first_unpainted_note)
+                {
+                    latency_stats_record (LATENCY_FIRST_PAINT, paint_time -
+                            ds_drumtrack_cursor_arrival_time (cursor));
+                    priv->first_unpainted_note = index + 1;
+                }
             }
 
-            int current_x = scope_x + (note->tick - priv->start_tick) * 
-                x_factor;
-            int current_y = priv->note_lines_ycoord[note->drum];
-            cogl_rectangle (current_x - 4, current_y - 4,
-                    current_x + 5, current_y + 5);
-
             cursor = ds_drumtrack_cursor_next (cursor);
         }
+
+        priv->first_undrawn_note = ds_drumtrack_cursor_index (cursor);
+    }
+
+    if (layered && priv->note_rectangles->len > 0)
+    {
+        CoglColor note_color;
+        cogl_color_set_from_4ub (&note_color, NOTE_COLOR[0], NOTE_COLOR[1],
+                NOTE_COLOR[2], 0xff);
+
+        cogl_set_draw_buffer (COGL_OFFSCREEN_BUFFER, priv->scope_fbo);
+        cogl_set_source_color (&note_color);
+        cogl_rectangles ((float *) priv->note_rectangles->data,
+                priv->note_rectangles->len / 4);
+        cogl_set_draw_buffer (COGL_WINDOW_BUFFER, COGL_INVALID_HANDLE);
+    }
+    else if (!layered)
+    {
+        scene_batch_submit (&priv->notes);
+    }
+
+    priv->notes_dirty = FALSE;
+    priv->new_notes = FALSE;
+}
+
+static void
+ds_drumscope_paint (ClutterActor *actor)
+{
+    DsDrumscope *drumscope = DS_DRUMSCOPE (actor);
+    DsDrumscopePrivate *priv = drumscope->priv;
+
+    ClutterGeometry geom;
+    clutter_actor_get_geometry (actor, &geom);
+
+    if (priv->scene_start_tick != priv->start_tick ||
+            priv->scene_stop_tick != priv->stop_tick ||
+            priv->scene_width != geom.width ||
+            priv->scene_height != geom.height)
+    {
+        priv->background_dirty = TRUE;
+        priv->notes_dirty = TRUE;
+    }
+
+    if (priv->background_dirty)
+    {
+        update_background (priv, &geom);
+    }
+    if (priv->notes_dirty || priv->new_notes)
+    {
+        update_notes (priv, &geom);
+    }
+
+    priv->scene_start_tick = priv->start_tick;
+    priv->scene_stop_tick = priv->stop_tick;
+    priv->scene_width = geom.width;
+    priv->scene_height = geom.height;
+
+    // Scrolling shows the range from the view start, to a fraction of a
+    // pixel
+    int scope_x = priv->max_label_width + LABEL_MARGIN;
+    float x_factor = get_x_factor (priv, &geom);
+    float offset = (priv->view_start_tick - priv->start_tick) * x_factor;
+
+    if (priv->scope_texture != COGL_INVALID_HANDLE)
+    {
+        float texture_width = priv->texture_width;
+
+        cogl_set_source_texture (priv->scope_texture);
+        cogl_rectangle_with_texture_coords (0, 0, scope_x, geom.height,
+                0, 0, scope_x / texture_width, 1);
+        cogl_rectangle_with_texture_coords (scope_x, 0, geom.width,
+                geom.height, (scope_x + offset) / texture_width, 0,
+                (geom.width + offset) / texture_width, 1);
+    }
+    else
+    {
+        paint_labels (priv);
+
+        cogl_clip_push (scope_x, 0, geom.width - scope_x, geom.height);
+        cogl_push_matrix ();
+        cogl_translate (-offset, 0, 0);
+        scene_batch_draw (&priv->background);
+        scene_batch_draw (&priv->notes);
+        cogl_pop_matrix ();
+        cogl_clip_pop ();
     }
+
+    // The cursor moves every frame, it is drawn on its own
+    CoglColor cursor_color;
+    cogl_color_set_from_4ub (&cursor_color, 0x80, 0xff, 0x80, 0xff);
+    cogl_set_source_color (&cursor_color);
+    float cursor_x = scope_x +
+        (priv->cursor_tick - priv->view_start_tick) * x_factor;
+    cogl_rectangle (cursor_x, 0, cursor_x + 1, geom.height);
 }
 
 
@@ -238,16 +639,44 @@ ds_drumscope_finalize (GObject *object)
     DsDrumscope *drumscope = DS_DRUMSCOPE (object);
     DsDrumscopePrivate *priv = drumscope->priv;
 
+    scene_batch_free (&priv->background);
+    scene_batch_free (&priv->notes);
+    g_array_free (priv->note_rectangles, TRUE);
+
     // Chain up
     G_OBJECT_CLASS (ds_drumscope_parent_class)->finalize (object);
 }
 
+static void unset_drumtrack (DsDrumscope *drumscope);
+
 static void
 ds_drumscope_dispose (GObject *object)
 {
     DsDrumscope *drumscope = DS_DRUMSCOPE (object);
     DsDrumscopePrivate *priv = drumscope->priv;
 
+    unset_drumtrack (drumscope);
+
+    if (priv->click_track != NULL)
+    {
+        click_track_unref (priv->click_track);
+        priv->click_track = NULL;
+    }
+
+    scene_batch_release (&priv->background);
+    scene_batch_release (&priv->notes);
+
+    if (priv->scope_fbo != COGL_INVALID_HANDLE)
+    {
+        cogl_handle_unref (priv->scope_fbo);
+        priv->scope_fbo = COGL_INVALID_HANDLE;
+    }
+    if (priv->scope_texture != COGL_INVALID_HANDLE)
+    {
+        cogl_handle_unref (priv->scope_texture);
+        priv->scope_texture = COGL_INVALID_HANDLE;
+    }
+
     for (int i = 0; i < NR_OF_NOTE_LINES; ++i)
     {
         if (priv->labels[i] != NULL)
@@ -278,6 +707,17 @@ ds_drumscope_class_init (DsDrumscopeClass *klass)
     g_type_class_add_private (gobject_class, sizeof (DsDrumscopePrivate));
 }
 
+/*
+ * Sets the lengths in ticks for ppq ticks per beat.
+ */
+static void
+set_ppq (DsDrumscopePrivate *priv, unsigned int ppq)
+{
+    priv->cursor_margin = ppq * CURSOR_MARGIN;
+    priv->scroll_ticks = ppq * 4 + priv->cursor_margin;
+    priv->visible_ticks = priv->scroll_ticks;
+}
+
 static void
 ds_drumscope_init (DsDrumscope *drumscope)
 {
@@ -287,15 +727,30 @@ ds_drumscope_init (DsDrumscope *drumscope)
 
     priv->continous_scroll = FALSE;
     priv->n_visible_measures = 2;
-    priv->cursor_margin = CURSOR_MARGIN;
-    priv->visible_ticks = 96 * 4 + priv->cursor_margin;
+    set_ppq (priv, CLICK_TRACK_DEFAULT_PPQ);
 
     priv->cursor_tick = 0;
+    priv->view_start_tick = 0;
     priv->start_tick = 0;
     priv->stop_tick = priv->visible_ticks;
 
     priv->drumtrack = NULL;
+    priv->drumtrack_changed_id = 0;
+    priv->first_unpainted_note = 0;
     priv->click_track = NULL;
+    priv->click_origin = 0;
+
+    scene_batch_init (&priv->background);
+    priv->scope_texture = COGL_INVALID_HANDLE;
+    priv->scope_fbo = COGL_INVALID_HANDLE;
+    priv->texture_width = 0;
+    priv->texture_height = 0;
+    priv->background_dirty = TRUE;
+    scene_batch_init (&priv->notes);
+    priv->note_rectangles = g_array_new (FALSE, FALSE, sizeof (float));
+    priv->notes_dirty = TRUE;
+    priv->new_notes = FALSE;
+    priv->first_undrawn_note = 0;
 
     ClutterColor text_color = {0xff, 0xff, 0xff, 0xff};
     for (int i = 0; i < NR_OF_NOTE_LINES; ++i)
@@ -323,24 +778,69 @@ ds_drumscope_new (void)
 }
 
 /**
- * Sets the click track for the drumscope. Ownership of the click track is not
- * taken and must be unset before it is deleted.
+ * Sets the click track for the drumscope. The drumscope holds a reference to
+ * the click track.
  */
 void
 ds_drumscope_set_click_track (DsDrumscope *drumscope,
         ClickTrack *click_track)
 {
-    // TODO: click track should be a weak reference
     DsDrumscopePrivate *priv = drumscope->priv;
 
+    click_track_ref (click_track);
+    if (priv->click_track != NULL)
+    {
+        click_track_unref (priv->click_track);
+    }
     priv->click_track = click_track;
-    // Setting the click track currently implies non-contiuous scrolling
-    priv->continous_scroll = FALSE;
+    priv->click_origin = 0;
+    priv->background_dirty = TRUE;
+    set_ppq (priv, click_track_get_ppq (click_track));
 
     // TODO: Handle this better
     ds_drumscope_reset (drumscope);
 }
 
+/**
+ * Switches to a click track that starts at origin without resetting the
+ * drumscope, for click tracks changed while playing. The cursor must be at
+ * or after origin. The drumscope holds a reference to the click track.
+ */
+void
+ds_drumscope_switch_click_track (DsDrumscope *drumscope,
+        ClickTrack *click_track, guint32 origin)
+{
+    DsDrumscopePrivate *priv = drumscope->priv;
+
+    click_track_ref (click_track);
+    if (priv->click_track != NULL)
+    {
+        click_track_unref (priv->click_track);
+    }
+    priv->click_track = click_track;
+    priv->click_origin = origin;
+    priv->background_dirty = TRUE;
+
+    // The next page starts with the first measure of the click track
+    priv->first_visible_click = click_track_cursor_shift (
+            click_track_begin (click_track), origin);
+    if (priv->continous_scroll)
+    {
+        priv->first_visible_click = seek_click (priv, 0, priv->start_tick);
+    }
+
+    ds_drumscope_set_cursor (drumscope, priv->cursor_tick);
+}
+
+/**
+ * Returns the click track of the drumscope, or NULL.
+ */
+ClickTrack *
+ds_drumscope_get_click_track (DsDrumscope *drumscope)
+{
+    return drumscope->priv->click_track;
+}
+
 static void
 on_drumtrack_delete (gpointer data, GObject *prev_address)
 {
@@ -348,6 +848,38 @@ on_drumtrack_delete (gpointer data, GObject *prev_address)
     DsDrumscopePrivate *priv = drumscope->priv;
 
     priv->drumtrack = NULL;
+    priv->notes_dirty = TRUE;
+}
+
+static void
+on_drumtrack_changed (DsDrumtrack *drumtrack, const DrumTrackRange *range,
+        gpointer data)
+{
+    DsDrumscope *drumscope = DS_DRUMSCOPE (data);
+    DsDrumscopePrivate *priv = drumscope->priv;
+
+    // Only redraw if any of the new notes are visible
+    if (range->end_tick >= priv->start_tick &&
+            range->start_tick < priv->stop_tick)
+    {
+        priv->new_notes = TRUE;
+        clutter_actor_queue_redraw (CLUTTER_ACTOR (drumscope));
+    }
+}
+
+static void
+unset_drumtrack (DsDrumscope *drumscope)
+{
+    DsDrumscopePrivate *priv = drumscope->priv;
+
+    if (priv->drumtrack != NULL)
+    {
+        g_signal_handler_disconnect (priv->drumtrack,
+                priv->drumtrack_changed_id);
+        g_object_weak_unref (G_OBJECT (priv->drumtrack), on_drumtrack_delete,
+                drumscope);
+        priv->drumtrack = NULL;
+    }
 }
 
 /**
@@ -359,17 +891,93 @@ ds_drumscope_set_drumtrack (DsDrumscope *drumscope, DsDrumtrack *new_drumtrack)
 {
     DsDrumscopePrivate *priv = drumscope->priv;
 
+    unset_drumtrack (drumscope);
+
     priv->drumtrack = new_drumtrack;
-    g_object_weak_ref (new_drumtrack, on_drumtrack_delete, drumscope);
+    priv->notes_dirty = TRUE;
+    priv->first_unpainted_note = ds_drumtrack_get_n_notes (new_drumtrack);
+    g_object_weak_ref (G_OBJECT (new_drumtrack), on_drumtrack_delete,
+            drumscope);
+    priv->drumtrack_changed_id = g_signal_connect (new_drumtrack, "changed",
+            G_CALLBACK (on_drumtrack_changed), drumscope);
+}
 
-    priv->first_visible_note = ds_drumtrack_begin (new_drumtrack);
+/*
+ * Starts the range drawn to the scope texture at the view, for continuous
+ * scrolling.
+ */
+static void
+set_scroll_range (DsDrumscopePrivate *priv)
+{
+    priv->start_tick = priv->view_start_tick;
+    priv->stop_tick = priv->start_tick + SCROLL_VIEWS * priv->visible_ticks;
+
+    if (priv->click_track != NULL)
+    {
+        priv->first_visible_click = seek_click (priv, 0, priv->start_tick);
+    }
+}
+
+/*
+ * Returns a cursor to the start of the measure that tick is in. Walks the
+ * measures from the start of the click track, which is only done when
+ * continuous scrolling is turned off.
+ */
+static ClickTrackCursor
+find_measure (DsDrumscopePrivate *priv, guint32 tick)
+{
+    ClickTrackCursor measure = click_track_cursor_shift (
+            click_track_begin (priv->click_track), priv->click_origin);
+    ClickTrackCursor next = click_track_cursor_next_measure (measure);
+
+    while (click_track_cursor_tick (next) <= tick)
+    {
+        measure = next;
+        next = click_track_cursor_next_measure (next);
+    }
+
+    return measure;
+}
+
+/**
+ * Selects if the drumscope scrolls continuously with the cursor instead of
+ * showing a page of measures at a time. Pages need a click track.
+ */
+void
+ds_drumscope_set_continuous_scroll (DsDrumscope *drumscope,
+        gboolean continuous_scroll)
+{
+    DsDrumscopePrivate *priv = drumscope->priv;
+
+    if (continuous_scroll == priv->continous_scroll)
+    {
+        return;
+    }
+    priv->continous_scroll = continuous_scroll;
+
+    if (continuous_scroll)
+    {
+        priv->visible_ticks = priv->scroll_ticks;
+        priv->view_start_tick = MAX (priv->cursor_tick + priv->cursor_margin -
+                (gdouble) priv->visible_ticks, 0);
+        set_scroll_range (priv);
+    }
+    else
+    {
+        g_assert (priv->click_track != NULL);
+
+        priv->first_visible_click = find_measure (priv, priv->cursor_tick);
+    }
+
+    ds_drumscope_set_cursor (drumscope, priv->cursor_tick);
 }
 
 /**
- * Sets drumscope cursor at tick. Currently the tick must always be increasing.
+ * Sets drumscope cursor at tick, which may be fractional for smooth cursor
+ * movement. Currently the tick must always be increasing.
  */
 void
-ds_drumscope_set_cursor (DsDrumscope *drumscope, const guint32 tick)
+ds_drumscope_set_cursor (DsDrumscope *drumscope, const gdouble tick)
 {
     DsDrumscopePrivate *priv = drumscope->priv;
 
@@ -379,15 +987,14 @@ ds_drumscope_set_cursor (DsDrumscope *drumscope, const guint32 tick)
 
     if (priv->continous_scroll)
     {
-        priv->stop_tick = priv->cursor_tick + priv->cursor_margin;
-        priv->start_tick = priv->stop_tick - priv->visible_ticks;
+        // Scrolls once the cursor is cursor_margin from the right edge
+        priv->view_start_tick = MAX (priv->cursor_tick + priv->cursor_margin -
+                (gdouble) priv->visible_ticks, 0);
 
-        // Update cursor to first visible click
-        while (click_track_cursor_tick (priv->first_visible_click)
-                < priv->start_tick)
+        if (priv->view_start_tick < priv->start_tick ||
+                priv->view_start_tick + priv->visible_ticks > priv->stop_tick)
         {
-            priv->first_visible_click = click_track_cursor_next_click (
-                    priv->first_visible_click);
+            set_scroll_range (priv);
         }
     }
     else
@@ -411,13 +1018,15 @@ ds_drumscope_set_cursor (DsDrumscope *drumscope, const guint32 tick)
         // +1 to include the bar of the next measure
         priv->stop_tick = click_track_cursor_tick (cursor) + 1;
         priv->visible_ticks = priv->stop_tick - priv->start_tick;
+        priv->view_start_tick = priv->start_tick;
     }
 
     clutter_actor_queue_redraw (CLUTTER_ACTOR (drumscope));
 }
 
 /**
- * Resets drumscope, moving cursor to position 0.
+ * Resets drumscope, moving cursor to position 0. The click track starts at 0
+ * again, as it does when drum I/O starts.
  */
 void
 ds_drumscope_reset (DsDrumscope *drumscope)
@@ -425,8 +1034,16 @@ ds_drumscope_reset (DsDrumscope *drumscope)
     DsDrumscopePrivate *priv = drumscope->priv;
 
     priv->cursor_tick = 0;
+    priv->view_start_tick = 0;
+    priv->click_origin = 0;
+    priv->background_dirty = TRUE;
+    priv->notes_dirty = TRUE;
 
-    if (priv->click_track != NULL)
+    if (priv->continous_scroll)
+    {
+        set_scroll_range (priv);
+    }
+    else if (priv->click_track != NULL)
     {
         priv->first_visible_click = click_track_begin (priv->click_track);
     }
@@ -65,9 +65,14 @@ GType ds_drumscope_get_type (void) G_GNUC_CONST;
 ClutterActor *ds_drumscope_new (void);
 void ds_drumscope_set_click_track (DsDrumscope *drumscope,
         ClickTrack *click_track);
+void ds_drumscope_switch_click_track (DsDrumscope *drumscope,
+        ClickTrack *click_track, guint32 origin);
+ClickTrack *ds_drumscope_get_click_track (DsDrumscope *drumscope);
 void ds_drumscope_set_drumtrack (DsDrumscope *drumscope, 
         DsDrumtrack *drumtrack);
-void ds_drumscope_set_cursor (DsDrumscope *drumscope, unsigned int ticks);
+void ds_drumscope_set_continuous_scroll (DsDrumscope *drumscope,
+        gboolean continuous_scroll);
+void ds_drumscope_set_cursor (DsDrumscope *drumscope, gdouble tick);
 void ds_drumscope_reset (DsDrumscope *drumscope);
 
 G_END_DECLS
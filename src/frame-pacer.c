@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frame-pacer.h"
+#include "latency-stats.h"
+
+#define DEFAULT_FRAME_INTERVAL 16667  // us, 60 Hz
+#define MISSED_FRAME_FACTOR 1.5  // Of the frame interval
+#define INTERVAL_SMOOTHING 0.05  // Part of a frame interval taken in
+
+struct FramePacer_
+{
+    ClutterActor *stage;
+    FramePacerFunc func;
+    gpointer data;
+    guint repaint_id;
+    gulong paint_id;
+
+    gboolean running;
+    gint64 frame_start;  // Time the frame being painted started, or 0
+    gint64 last_frame_start;  // 0 before the first frame
+    gdouble frame_interval;
+
+    guint n_frames;
+    guint missed_frames;
+};
+
+/*
+ * Runs before the stage is painted. The frame will be presented at the
+ * first refresh after it is painted, one frame interval from now.
+ */
+static gboolean
+on_repaint (gpointer data)
+{
+    FramePacer *pacer = data;
+
+    if (!pacer->running)
+    {
+        return TRUE;
+    }
+
+    gint64 now = latency_stats_now ();
+    if (pacer->last_frame_start != 0)
+    {
+        gint64 interval = now - pacer->last_frame_start;
+        latency_stats_record (LATENCY_FRAME_INTERVAL, interval);
+
+        if (interval > pacer->frame_interval * MISSED_FRAME_FACTOR)
+        {
+            pacer->missed_frames++;
+        }
+        pacer->frame_interval +=
+            (interval - pacer->frame_interval) * INTERVAL_SMOOTHING;
+    }
+    pacer->last_frame_start = now;
+    pacer->frame_start = now;
+    pacer->n_frames++;
+
+    pacer->func (now + pacer->frame_interval, pacer->data);
+
+    return TRUE;
+}
+
+/*
+ * Runs after the stage is painted, and asks for the next frame. The stage
+ * is painted again once the buffers have been swapped.
+ */
+static void
+on_stage_paint (ClutterActor *stage, gpointer data)
+{
+    FramePacer *pacer = data;
+
+    if (pacer->frame_start != 0)
+    {
+        latency_stats_record (LATENCY_PAINT,
+                latency_stats_now () - pacer->frame_start);
+        pacer->frame_start = 0;
+    }
+
+    if (pacer->running)
+    {
+        clutter_actor_queue_redraw (stage);
+    }
+}
+
+/**
+ * Creates a frame pacer for stage that calls func before each frame while
+ * it is running.
+ */
+FramePacer *
+frame_pacer_new (ClutterActor *stage, FramePacerFunc func, gpointer data)
+{
+    FramePacer *pacer = g_new (FramePacer, 1);
+
+    pacer->stage = stage;
+    pacer->func = func;
+    pacer->data = data;
+    pacer->running = FALSE;
+    pacer->frame_start = 0;
+    pacer->last_frame_start = 0;
+    pacer->frame_interval = DEFAULT_FRAME_INTERVAL;
+    pacer->n_frames = 0;
+    pacer->missed_frames = 0;
+
+    pacer->repaint_id = clutter_threads_add_repaint_func (on_repaint, pacer,
+            NULL);
+    pacer->paint_id = g_signal_connect_after (stage, "paint",
+            G_CALLBACK (on_stage_paint), pacer);
+
+    return pacer;
+}
+
+void
+frame_pacer_free (FramePacer *pacer)
+{
+    clutter_threads_remove_repaint_func (pacer->repaint_id);
+    g_signal_handler_disconnect (pacer->stage, pacer->paint_id);
+    g_free (pacer);
+}
+
+/**
+ * Starts painting frames continuously.
+ */
+void
+frame_pacer_start (FramePacer *pacer)
+{
+    pacer->running = TRUE;
+    pacer->last_frame_start = 0;
+    clutter_actor_queue_redraw (pacer->stage);
+}
+
+/**
+ * Stops painting frames, the stage is only painted when needed again.
+ */
+void
+frame_pacer_stop (FramePacer *pacer)
+{
+    pacer->running = FALSE;
+}
+
+/**
+ * Gets the frame statistics collected since the pacer was created.
+ */
+void
+frame_pacer_get_stats (FramePacer *pacer, FramePacerStats *stats)
+{
+    stats->n_frames = pacer->n_frames;
+    stats->missed_frames = pacer->missed_frames;
+    stats->frame_interval = pacer->frame_interval;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_PACER_H__
+#define __FRAME_PACER_H__
+
+#include <clutter/clutter.h>
+#include <glib.h>
+
+/*
+ * Paces updates of the stage to the frames the stage paints, which with
+ * sync to vblank follow the display refresh. Before each frame is painted
+ * the frame function gets the time the frame is expected to be presented.
+ * Frame intervals and paint times are recorded in the latency stats.
+ */
+typedef struct FramePacer_ FramePacer;
+
+/*
+ * Called before a frame is painted. Present_time is the monotonic time in us
+ * at which the frame is expected to be shown.
+ */
+typedef void (*FramePacerFunc) (gint64 present_time, gpointer data);
+
+typedef struct FramePacerStats_ FramePacerStats;
+
+struct FramePacerStats_
+{
+    guint n_frames;
+    guint missed_frames;  // Frames shown at least one refresh late
+    gdouble frame_interval;  // us, estimated display refresh interval
+};
+
+FramePacer *frame_pacer_new (ClutterActor *stage, FramePacerFunc func,
+        gpointer data);
+void frame_pacer_free (FramePacer *pacer);
+
+void frame_pacer_start (FramePacer *pacer);
+void frame_pacer_stop (FramePacer *pacer);
+void frame_pacer_get_stats (FramePacer *pacer, FramePacerStats *stats);
+
+#endif // __FRAME_PACER_H__
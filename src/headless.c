@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "headless.h"
+#include "drum-io.h"
+#include "click-pattern.h"
+#include "latency-stats.h"
+
+#include <glib.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERRUPT_CHECK_INTERVAL 100  // ms
+#define MIN_TEMPO 30  // bpm, as in the main window
+#define MAX_TEMPO 300
+
+static GMainLoop *main_loop = NULL;
+static volatile sig_atomic_t interrupted = 0;
+
+static void
+on_signal (int signum)
+{
+    interrupted = 1;
+}
+
+static gboolean
+on_interrupt_check (gpointer data)
+{
+    if (interrupted)
+    {
+        g_main_loop_quit (main_loop);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+on_duration_elapsed (gpointer data)
+{
+    g_main_loop_quit (main_loop);
+
+    return FALSE;
+}
+
+/*
+ * Writes one line per note: tick, drum, velocity and arrival time in us. The
+ * tick has a fraction when input is stamped with real time.
+ */
+static gboolean
+write_recording (DsDrumtrack *drumtrack, const char *filename)
+{
+    FILE *file = fopen (filename, "w");
+    if (file == NULL)
+    {
+        return FALSE;
+    }
+
+    fprintf (file, "# tick drum velocity arrival_time\n");
+
+    DrumTrackCursor cursor = ds_drumtrack_begin (drumtrack);
+    while (!ds_drumtrack_cursor_at_end (cursor))
+    {
+        fprintf (file, "%.3f %d %d %lld\n",
+                ds_drumtrack_cursor_fractional_tick (cursor),
+                ds_drumtrack_cursor_drum (cursor),
+                ds_drumtrack_cursor_velocity (cursor) >> (32 - 7),
+                (long long) ds_drumtrack_cursor_arrival_time (cursor));
+
+        cursor = ds_drumtrack_cursor_next (cursor);
+    }
+
+    return fclose (file) == 0;
+}
+
+/*
+ * Creates the tempo map that takes the tempo from options->tempo to
+ * options->tempo_target, one options->tempo_step per
+ * options->tempo_step_bars measures. Returns NULL if tempo is constant.
+ */
+static TempoMap *
+create_tempo_map (const HeadlessOptions *options,
+        const ClickTrack *click_track)
+{
+    if (options->tempo_target == 0 ||
+            options->tempo_target == options->tempo)
+    {
+        return NULL;
+    }
+
+    int distance = ABS (options->tempo_target - options->tempo);
+    int direction = options->tempo_target > options->tempo ? 1 : -1;
+    int n_steps = (distance + options->tempo_step - 1) / options->tempo_step;
+
+    TempoMap *tempo_map = tempo_map_new (click_track_get_ppq (click_track),
+            options->tempo);
+
+    if (strcmp (options->tempo_ramp, "step") == 0)
+    {
+        for (int i = 1; i <= n_steps; ++i)
+        {
+            int bpm = options->tempo + direction * MIN (i * options->tempo_step,
+                    distance);
+            tempo_map_set_tempo (tempo_map, click_track_measure_start_tick (
+                        click_track, i * options->tempo_step_bars), bpm);
+        }
+    }
+    else
+    {
+        TempoRamp ramp = strcmp (options->tempo_ramp, "exponential") == 0 ?
+            TEMPO_RAMP_EXPONENTIAL : TEMPO_RAMP_LINEAR;
+        unsigned int end_tick = click_track_measure_start_tick (click_track,
+                n_steps * options->tempo_step_bars);
+
+        tempo_map_add_ramp (tempo_map, 0, end_tick, options->tempo_target,
+                ramp);
+    }
+
+    return tempo_map;
+}
+
+static void
+print_stats (DsDrumtrack *drumtrack, gint64 elapsed)
+{
+    DrumIoStats stats;
+    drum_io_get_stats (&stats);
+
+    guint n_unknown_notes = 0;
+    for (int i = 0; i < DRUM_MAP_N_NOTES; ++i)
+    {
+        n_unknown_notes += stats.unknown_notes[i];
+    }
+
+    guint n_notes = ds_drumtrack_get_n_notes (drumtrack);
+    double seconds = elapsed / (double) G_USEC_PER_SEC;
+
+    printf ("Run time (s)         %.3f\n", seconds);
+    printf ("Notes                %u\n", n_notes);
+    printf ("Notes per second     %.1f\n", seconds > 0 ? n_notes / seconds : 0);
+    printf ("Unknown notes        %u\n", n_unknown_notes);
+    printf ("Dropped notes        %u\n", stats.dropped_notes);
+    printf ("Note pool exhausted  %u\n", stats.note_pool_exhausted);
+    printf ("Clicks scheduled     %u\n", stats.clicks_scheduled);
+    printf ("Output flushes       %u\n", stats.output_flushes);
+    printf ("Pool full retries    %u\n", stats.pool_full_retries);
+    printf ("Late audio clicks    %u\n", stats.late_audio_clicks);
+    printf ("Audio xruns          %u\n", stats.audio_xruns);
+
+    latency_stats_dump (stdout);
+}
+
+/**
+ * Runs the click and note capture without any user interface until the
+ * duration has passed or the process is interrupted, then prints statistics.
+ * Drum I/O must be initiated. Returns the exit status.
+ */
+int
+headless_run (const HeadlessOptions *options)
+{
+    if (strcmp (options->tempo_ramp, "step") != 0 &&
+            strcmp (options->tempo_ramp, "linear") != 0 &&
+            strcmp (options->tempo_ramp, "exponential") != 0)
+    {
+        g_print ("unknown tempo ramp %s\n", options->tempo_ramp);
+        return EXIT_FAILURE;
+    }
+
+    // The target is optional, 0 keeps the tempo
+    if (options->tempo < MIN_TEMPO || options->tempo > MAX_TEMPO ||
+            (options->tempo_target != 0 &&
+             (options->tempo_target < MIN_TEMPO ||
+              options->tempo_target > MAX_TEMPO)))
+    {
+        g_print ("tempo must be between %d and %d bpm\n", MIN_TEMPO,
+                MAX_TEMPO);
+        return EXIT_FAILURE;
+    }
+    if (options->tempo_step <= 0 || options->tempo_step_bars <= 0)
+    {
+        g_print ("tempo step and tempo step bars must be positive\n");
+        return EXIT_FAILURE;
+    }
+    if (options->beats_per_measure <= 0)
+    {
+        g_print ("beats must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    g_type_init ();
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+
+    DsDrumtrack *drumtrack = ds_drumtrack_new ();
+    drum_io_set_drumtrack (drumtrack);
+    ClickTrack *click_track;
+    if (options->pattern != NULL)
+    {
+        GError *error = NULL;
+        click_track = click_pattern_compile (options->pattern,
+                drum_io_get_ppq (), &error);
+        if (click_track == NULL)
+        {
+            g_print ("invalid click pattern: %s\n", error->message);
+            g_error_free (error);
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        GError *error = NULL;
+        click_track = click_track_create (options->beats_per_measure,
+                SUB_ONE, drum_io_get_ppq (), &error);
+        if (click_track == NULL)
+        {
+            g_print ("unsupported click track: %s\n", error->message);
+            g_error_free (error);
+            return EXIT_FAILURE;
+        }
+    }
+
+    drum_io_set_playback_tempo (options->tempo);
+    TempoMap *tempo_map = create_tempo_map (options, click_track);
+    if (tempo_map != NULL)
+    {
+        drum_io_set_tempo_map (tempo_map);
+    }
+    drum_io_set_click_track (click_track);
+
+    GSource *io_source = drum_io_source_new ();
+    g_source_attach (io_source, NULL);
+
+    signal (SIGINT, on_signal);
+    signal (SIGTERM, on_signal);
+    g_timeout_add (INTERRUPT_CHECK_INTERVAL, on_interrupt_check, NULL);
+    if (options->duration > 0)
+    {
+        g_timeout_add_seconds (options->duration, on_duration_elapsed, NULL);
+    }
+
+    gint64 start_time = latency_stats_now ();
+    drum_io_start ();
+
+    g_main_loop_run (main_loop);
+
+    drum_io_stop ();
+    gint64 elapsed = latency_stats_now () - start_time;
+
+    g_source_destroy (io_source);
+    g_source_unref (io_source);
+    g_main_loop_unref (main_loop);
+
+    print_stats (drumtrack, elapsed);
+
+    int status = EXIT_SUCCESS;
+    if (options->record_filename != NULL &&
+            !write_recording (drumtrack, options->record_filename))
+    {
+        g_print ("could not write recording to %s\n",
+                options->record_filename);
+        status = EXIT_FAILURE;
+    }
+
+    g_object_unref (drumtrack);
+
+    return status;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+typedef struct HeadlessOptions_ HeadlessOptions;
+
+struct HeadlessOptions_
+{
+    int tempo;  // Beats per minute
+    int tempo_target;  // Tempo to speed up or slow down to, 0 to keep tempo
+    int tempo_step;  // BPM to change tempo by every tempo_step_bars
+    int tempo_step_bars;
+    const char *tempo_ramp;  // "step", "linear" or "exponential"
+    int beats_per_measure;
+    const char *pattern;  // Click pattern, or NULL to use beats_per_measure
+    int duration;  // Seconds to run, 0 runs until interrupted
+    const char *record_filename;  // Where to write the notes, or NULL
+};
+
+int headless_run (const HeadlessOptions *options);
+
+#endif // __HEADLESS_H__
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "latency-stats.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+ * The histograms have log-linear buckets, as in HdrHistogram. Values below
+ * N_SUB_BUCKETS us get one bucket each, above that every power of two range
+ * is split into N_SUB_BUCKETS buckets. That keeps the error within 1/16 of
+ * the value with a few hundred counters per histogram.
+ */
+#define SUB_BUCKET_BITS 4
+#define N_SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_LATENCY G_MAXINT32  // us, larger values are clamped
+#define N_BUCKETS ((31 - SUB_BUCKET_BITS + 1) * N_SUB_BUCKETS)
+
+typedef struct Histogram_ Histogram;
+
+struct Histogram_
+{
+    volatile gint count;
+    volatile gint max;
+    volatile gint buckets[N_BUCKETS];
+};
+
+static Histogram histograms[LATENCY_N_STAGES];
+
+static const char * const stage_names[LATENCY_N_STAGES] = {
+    "ingest", "handoff", "first paint", "paint", "frame" };
+
+static guint
+get_bucket (guint32 latency)
+{
+    if (latency < N_SUB_BUCKETS)
+    {
+        return latency;
+    }
+
+    guint shift = g_bit_storage (latency) - 1 - SUB_BUCKET_BITS;
+
+    return (shift + 1) * N_SUB_BUCKETS + (latency >> shift) - N_SUB_BUCKETS;
+}
+
+/*
+ * Returns the largest latency that falls in bucket.
+ */
+static gint64
+get_bucket_max (guint bucket)
+{
+    if (bucket < N_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    guint shift = bucket / N_SUB_BUCKETS - 1;
+    guint sub_bucket = bucket % N_SUB_BUCKETS;
+
+    return ((gint64) (N_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+/**
+ * Returns the current time of the monotonic clock, in us.
+ */
+gint64
+latency_stats_now (void)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+/**
+ * Records a latency, in us, for stage.
+ */
+void
+latency_stats_record (LatencyStage stage, gint64 latency)
+{
+    Histogram *histogram = &histograms[stage];
+    gint value = CLAMP (latency, 0, MAX_LATENCY);
+
+    g_atomic_int_inc (&histogram->buckets[get_bucket (value)]);
+    g_atomic_int_inc (&histogram->count);
+
+    gint max = g_atomic_int_get (&histogram->max);
+    while (value > max &&
+            !g_atomic_int_compare_and_exchange (&histogram->max, max, value))
+    {
+        max = g_atomic_int_get (&histogram->max);
+    }
+}
+
+/**
+ * Returns the number of latencies recorded for stage.
+ */
+guint
+latency_stats_get_count (LatencyStage stage)
+{
+    return g_atomic_int_get (&histograms[stage].count);
+}
+
+/**
+ * Returns the latency, in us, that percentile percent of the recorded
+ * latencies for stage are less than or equal to. The result is rounded up
+ * to the end of its bucket. Returns 0 if nothing is recorded.
+ */
+gint64
+latency_stats_get_percentile (LatencyStage stage, double percentile)
+{
+    Histogram *histogram = &histograms[stage];
+
+    guint count = g_atomic_int_get (&histogram->count);
+    guint64 wanted = (guint64) (count * percentile / 100.0 + 0.5);
+    wanted = CLAMP (wanted, 1, count);
+
+    guint64 seen = 0;
+    for (guint i = 0; i < N_BUCKETS && count > 0; ++i)
+    {
+        seen += g_atomic_int_get (&histogram->buckets[i]);
+        if (seen >= wanted)
+        {
+            return MIN (get_bucket_max (i), latency_stats_get_max (stage));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the largest latency, in us, recorded for stage.
+ */
+gint64
+latency_stats_get_max (LatencyStage stage)
+{
+    return g_atomic_int_get (&histograms[stage].max);
+}
+
+/**
+ * Clears all histograms. Must not be called while latencies are recorded.
+ */
+void
+latency_stats_reset (void)
+{
+    memset (histograms, 0, sizeof (histograms));
+}
+
+/**
+ * Writes a summary of all histograms to file.
+ */
+void
+latency_stats_dump (FILE *file)
+{
+    fprintf (file, "Latency (us)       count      50%%      90%%      99%%"
+            "    99.9%%      max\n");
+
+    for (int i = 0; i < LATENCY_N_STAGES; ++i)
+    {
+        fprintf (file, "%-12s %11u %8lld %8lld %8lld %8lld %8lld\n",
+                stage_names[i], latency_stats_get_count (i),
+                (long long) latency_stats_get_percentile (i, 50.0),
+                (long long) latency_stats_get_percentile (i, 90.0),
+                (long long) latency_stats_get_percentile (i, 99.0),
+                (long long) latency_stats_get_percentile (i, 99.9),
+                (long long) latency_stats_get_max (i));
+    }
+}
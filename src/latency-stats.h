@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LATENCY_STATS_H__
+#define __LATENCY_STATS_H__
+
+#include <glib.h>
+#include <stdio.h>
+
+/*
+ * Latency histograms for the path from a pad hit to the note being drawn,
+ * and for the frames that draw it. Recording is lock free and may be done
+ * from any thread.
+ */
+typedef enum LatencyStage_ LatencyStage;
+
+enum LatencyStage_
+{
+    LATENCY_INGEST,  // I/O wakeup to note read from the sequencer
+    LATENCY_HANDOFF,  // Note read to note added to the drumtrack
+    LATENCY_FIRST_PAINT,  // Note read to note first drawn, if it is visible
+    LATENCY_PAINT,  // Frame started to frame painted
+    LATENCY_FRAME_INTERVAL,  // Between the starts of frames
+    LATENCY_N_STAGES
+};
+
+gint64 latency_stats_now (void);
+
+void latency_stats_record (LatencyStage stage, gint64 latency);
+guint latency_stats_get_count (LatencyStage stage);
+gint64 latency_stats_get_percentile (LatencyStage stage, double percentile);
+gint64 latency_stats_get_max (LatencyStage stage);
+void latency_stats_reset (void);
+void latency_stats_dump (FILE *file);
+
+#endif // __LATENCY_STATS_H__
@@ -19,14 +19,19 @@
 
 #include "drumscope-actor.h"
 #include "drum-io.h"
+#include "click-pattern.h"
+#include "frame-pacer.h"
 
 #include <gtk/gtk.h>
 #include <clutter/clutter.h>
 #include <clutter-gtk/clutter-gtk.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #define NR_OF_SUBDIVISIONS 5
+#define NR_OF_POLYRHYTHMS 5
+#define POLYRHYTHM_NOTE 25
 
 struct StringSubdivisionPair_
 {
@@ -36,22 +41,59 @@ struct StringSubdivisionPair_
 
 typedef struct StringSubdivisionPair_ StringSubdivisionPair;
 
+struct StringPolyrhythmPair_
+{
+    const char *description;
+    int n_pulses;  // Played over n_beats, 0 for no polyrhythm
+    int n_beats;
+};
+
+typedef struct StringPolyrhythmPair_ StringPolyrhythmPair;
+
 static ClutterActor *drumscope = NULL;
-static ClutterTimeline *timeline = NULL;
+static FramePacer *frame_pacer = NULL;
+static GSource *io_source = NULL;
 static gboolean metronome_running = FALSE;
+static guint32 scope_click_origin = 0;  // Of the click track in drumscope
 static GtkWidget *subdivision_combo_box = NULL;
 static GtkWidget *beats_spin_button = NULL;
+static GtkWidget *polyrhythm_combo_box = NULL;
+static GtkWidget *pattern_entry = NULL;
 static StringSubdivisionPair subdivision_pairs[NR_OF_SUBDIVISIONS] = { 
     { "One", SUB_ONE },
     { "Two", SUB_TWO },
     { "Shuffle", SUB_SHUFFLE },
     { "Three", SUB_THREE }, 
     { "Four", SUB_FOUR } };
+static StringPolyrhythmPair polyrhythm_pairs[NR_OF_POLYRHYTHMS] = {
+    { "None", 0, 0 },
+    { "3:2", 3, 2 },
+    { "2:3", 2, 3 },
+    { "4:3", 4, 3 },
+    { "5:4", 5, 4 } };
 
+/*
+ * Moves the drumscope cursor to where the queue will be when the frame is
+ * shown.
+ */
 static void
-on_timeline_new_frame (ClutterTimeline *timeline, gint frame_num, gpointer data)
+on_frame (gint64 present_time, gpointer data)
 {
-    guint32 current_tick = drum_io_poll ();
+    gdouble current_tick = drum_io_get_fractional_tick_at (present_time);
+
+    // Follow click tracks changed while playing
+    guint32 origin;
+    ClickTrack *click_track = drum_io_get_click_track_at (current_tick,
+            &origin);
+    if (click_track != NULL && (origin != scope_click_origin ||
+                click_track != ds_drumscope_get_click_track (
+                    DS_DRUMSCOPE (drumscope))))
+    {
+        ds_drumscope_switch_click_track (DS_DRUMSCOPE (drumscope),
+                click_track, origin);
+        scope_click_origin = origin;
+    }
+
     ds_drumscope_set_cursor (DS_DRUMSCOPE (drumscope), current_tick);
 }
 
@@ -68,26 +110,23 @@ on_start_button_clicked (GtkButton *button, gpointer user_data)
         g_object_unref (drumtrack);
         ds_drumscope_set_drumtrack (DS_DRUMSCOPE (drumscope), drumtrack);
         ds_drumscope_reset (DS_DRUMSCOPE (drumscope));
+        scope_click_origin = 0;
 
         gtk_button_set_label (button, "Stop");
-        gtk_widget_set_sensitive (subdivision_combo_box, FALSE);
-        gtk_widget_set_sensitive (beats_spin_button, FALSE);
 
         // Start everything
         drum_io_start ();
-        clutter_timeline_start (timeline);
+        frame_pacer_start (frame_pacer);
 
     }
     else
     {
         // Update UI
         gtk_button_set_label (button, "Start");
-        gtk_widget_set_sensitive (subdivision_combo_box, TRUE);
-        gtk_widget_set_sensitive (beats_spin_button, TRUE);
 
         // Stop everything
         drum_io_stop ();
-        clutter_timeline_stop (timeline);
+        frame_pacer_stop (frame_pacer);
     }
 
     return TRUE;
@@ -102,9 +141,29 @@ on_tempo_value_changed (GtkSpinButton *spin_button, gpointer user_data)
     return TRUE;
 }
 
-static gboolean
-on_beat_config_changed (GtkWidget *widget, gpointer user_data)
+/*
+ * Creates the click track of the beat controls, or of the pattern if one is
+ * entered. Returns NULL if the pattern is invalid or the beats do not split
+ * into the subdivision at the queue ppq.
+ */
+static ClickTrack *
+create_click_track (void)
 {
+    const gchar *pattern = gtk_entry_get_text (GTK_ENTRY (pattern_entry));
+    if (pattern[0] != '\0')
+    {
+        GError *error = NULL;
+        ClickTrack *click_track = click_pattern_compile (pattern,
+                drum_io_get_ppq (), &error);
+        if (click_track == NULL)
+        {
+            g_print ("invalid click pattern: %s\n", error->message);
+            g_error_free (error);
+        }
+
+        return click_track;
+    }
+
     gint n_beats = gtk_spin_button_get_value_as_int (
             GTK_SPIN_BUTTON (beats_spin_button));
     gint subdivision_entry = gtk_combo_box_get_active (
@@ -112,14 +171,59 @@ on_beat_config_changed (GtkWidget *widget, gpointer user_data)
     ClickSubdivision subdivision = 
         subdivision_pairs[subdivision_entry].subdivision;
 
+    gint polyrhythm_entry = gtk_combo_box_get_active (
+            GTK_COMBO_BOX (polyrhythm_combo_box));
+    const StringPolyrhythmPair *polyrhythm =
+        &polyrhythm_pairs[polyrhythm_entry];
+
+    GError *error = NULL;
     ClickTrack *click_track = click_track_create (n_beats,
-            subdivision);
-    ds_drumscope_set_click_track (DS_DRUMSCOPE (drumscope), click_track);
+            subdivision, drum_io_get_ppq (), &error);
+    if (click_track == NULL)
+    {
+        g_print ("unsupported click track: %s\n", error->message);
+        g_error_free (error);
+        return NULL;
+    }
+    if (polyrhythm->n_pulses > 0)
+    {
+        click_track_add_layer (click_track, polyrhythm->n_pulses,
+                polyrhythm->n_beats, NULL, CLICK_TRACK_DEFAULT_CHANNEL,
+                POLYRHYTHM_NOTE);
+    }
+
+    return click_track;
+}
+
+static gboolean
+on_beat_config_changed (GtkWidget *widget, gpointer user_data)
+{
+    ClickTrack *click_track = create_click_track ();
+    if (click_track == NULL)
+    {
+        return TRUE;
+    }
+
+    // While running the drumscope follows drum I/O, see on_frame()
+    if (!metronome_running)
+    {
+        ds_drumscope_set_click_track (DS_DRUMSCOPE (drumscope), click_track);
+        scope_click_origin = 0;
+    }
     drum_io_set_click_track (click_track);
 
     return TRUE;
 }
 
+static gboolean
+on_scroll_toggled (GtkToggleButton *toggle_button, gpointer user_data)
+{
+    ds_drumscope_set_continuous_scroll (DS_DRUMSCOPE (drumscope),
+            gtk_toggle_button_get_active (toggle_button));
+
+    return TRUE;
+}
+
 static gboolean
 on_stage_size_changed (GtkWidget *widget, GdkEventConfigure *event,
         gpointer data)
@@ -173,6 +277,28 @@ create_main_window ()
     gtk_combo_box_set_active (GTK_COMBO_BOX (subdivision_combo_box), 0);
     gtk_box_pack_start (GTK_BOX (hbox), subdivision_combo_box, FALSE, FALSE, 0);
 
+    GtkWidget *polyrhythm_label = gtk_label_new ("Polyrhythm:");
+    gtk_box_pack_start (GTK_BOX (hbox), polyrhythm_label, FALSE, FALSE, 0);
+
+    polyrhythm_combo_box = gtk_combo_box_new_text ();
+    for (int i = 0; i < NR_OF_POLYRHYTHMS; ++i)
+    {
+        gtk_combo_box_append_text (GTK_COMBO_BOX (polyrhythm_combo_box),
+                polyrhythm_pairs[i].description);
+    }
+    gtk_combo_box_set_active (GTK_COMBO_BOX (polyrhythm_combo_box), 0);
+    gtk_box_pack_start (GTK_BOX (hbox), polyrhythm_combo_box, FALSE, FALSE, 0);
+
+    GtkWidget *pattern_label = gtk_label_new ("Pattern:");
+    gtk_box_pack_start (GTK_BOX (hbox), pattern_label, FALSE, FALSE, 0);
+
+    pattern_entry = gtk_entry_new ();
+    gtk_box_pack_start (GTK_BOX (hbox), pattern_entry, TRUE, TRUE, 0);
+
+    GtkWidget *scroll_check_button = gtk_check_button_new_with_label (
+            "Scroll");
+    gtk_box_pack_start (GTK_BOX (hbox), scroll_check_button, FALSE, FALSE, 0);
+
     GtkWidget *clutter_widget = gtk_clutter_embed_new ();
     gtk_box_pack_start (GTK_BOX (vbox), clutter_widget, TRUE, TRUE, 0);
     gtk_widget_set_size_request (clutter_widget, 320, 240);
@@ -189,9 +315,12 @@ create_main_window ()
     clutter_actor_set_position (drumscope, 0, 0);
     clutter_container_add_actor (CLUTTER_CONTAINER (stage), drumscope);
 
-    // TODO: Move this somewhere?
-    timeline = clutter_timeline_new (100);
-    clutter_timeline_set_loop (timeline, TRUE);
+    // Drum I/O is handled by the main loop as soon as input arrives
+    io_source = drum_io_source_new ();
+    g_source_attach (io_source, NULL);
+
+    // The drumscope follows drum I/O once per frame while running
+    frame_pacer = frame_pacer_new (stage, on_frame, NULL);
 
     // Setup event handlers
     g_signal_connect (G_OBJECT (start_button), "clicked",
@@ -203,9 +332,12 @@ create_main_window ()
             G_CALLBACK (on_beat_config_changed), NULL);
     g_signal_connect (G_OBJECT (subdivision_combo_box), "changed",
             G_CALLBACK (on_beat_config_changed), NULL);
-
-    g_signal_connect (G_OBJECT (timeline), "new-frame",
-            G_CALLBACK (on_timeline_new_frame), NULL);
+    g_signal_connect (G_OBJECT (polyrhythm_combo_box), "changed",
+            G_CALLBACK (on_beat_config_changed), NULL);
+    g_signal_connect (G_OBJECT (pattern_entry), "activate",
+            G_CALLBACK (on_beat_config_changed), NULL);
+    g_signal_connect (G_OBJECT (scroll_check_button), "toggled",
+            G_CALLBACK (on_scroll_toggled), NULL);
 
     g_signal_connect (G_OBJECT (clutter_widget), "configure_event",
             G_CALLBACK (on_stage_size_changed), NULL);
@@ -222,9 +354,24 @@ create_main_window ()
     return window;
 }
 
+/**
+ * Writes the frame counts of the frame pacer to file.
+ */
+void
+main_window_dump_frame_stats (FILE *file)
+{
+    FramePacerStats stats;
+    frame_pacer_get_stats (frame_pacer, &stats);
+    fprintf (file, "Frames %u, missed %u, refresh interval %.0f us\n",
+            stats.n_frames, stats.missed_frames, stats.frame_interval);
+}
+
 void
 delete_main_window ()
 {
-    g_object_unref (timeline);
+    frame_pacer_free (frame_pacer);
+
+    g_source_destroy (io_source);
+    g_source_unref (io_source);
 }
 
@@ -20,9 +20,11 @@
 #ifndef __MAIN_WINDOW_H__
 #define __MAIN_WINDOW_H__
 
+#include <stdio.h>
 #include <gtk/gtk.h>
 
 GtkWidget *create_main_window ();
+void main_window_dump_frame_stats (FILE *file);
 void delete_main_window ();
 
 #endif // __MAIN_WINDOW_H__
@@ -24,12 +24,24 @@
 #include <clutter/clutter.h>
 
 #include "drum-io.h"
+#include "headless.h"
+#include "latency-stats.h"
 #include "main-window.h"
 
 static gint input_client = 20;
 static gint input_port = 1;
 static gint output_client = 20;
 static gint output_port = 0;
+static gboolean io_thread = FALSE;
+static gint ppq = 0;
+static gboolean real_time_input = FALSE;
+static gchar *audio_click_device = NULL;
+static gchar *kit_profile = NULL;
+static gboolean headless = FALSE;
+static gboolean frame_stats = FALSE;
+static HeadlessOptions headless_options = { tempo: 120, tempo_target: 0,
+    tempo_step: 2, tempo_step_bars: 8, tempo_ramp: "step",
+    beats_per_measure: 4, pattern: NULL, duration: 0, record_filename: NULL };
 
 static GOptionEntry option_entries[] =
 {
@@ -41,17 +53,73 @@ static GOptionEntry option_entries[] =
         "Alsa client id to use for midi output", "id"},
     { "output-port", 0, 0, G_OPTION_ARG_INT, &output_port,
         "Port id to use for midi output", "port"},
+    { "io-thread", 0, 0, G_OPTION_ARG_NONE, &io_thread,
+        "Handle midi I/O in a separate realtime thread", NULL},
+    { "ppq", 0, 0, G_OPTION_ARG_INT, &ppq,
+        "Ticks per beat of the sequencer queue", "n"},
+    { "real-time-input", 0, 0, G_OPTION_ARG_NONE, &real_time_input,
+        "Stamp midi input with real time for timing within a tick", NULL},
+    { "audio-click", 0, 0, G_OPTION_ARG_STRING, &audio_click_device,
+        "Play clicks on an alsa pcm device instead of midi output",
+        "device"},
+    { "kit-profile", 0, 0, G_OPTION_ARG_FILENAME, &kit_profile,
+        "Kit profile that maps midi notes to drums", "file"},
+    { "headless", 0, 0, G_OPTION_ARG_NONE, &headless,
+        "Run the metronome and capture notes without a display", NULL},
+    { "frame-stats", 0, 0, G_OPTION_ARG_NONE, &frame_stats,
+        "Print frame counts on exit", NULL},
+    { NULL }
+};
+
+static GOptionEntry headless_option_entries[] =
+{
+    { "tempo", 0, 0, G_OPTION_ARG_INT, &headless_options.tempo,
+        "Tempo in beats per minute", "bpm"},
+    { "tempo-target", 0, 0, G_OPTION_ARG_INT, &headless_options.tempo_target,
+        "Change tempo gradually until reaching this tempo", "bpm"},
+    { "tempo-step", 0, 0, G_OPTION_ARG_INT, &headless_options.tempo_step,
+        "Change tempo by this much towards the target tempo, default 2",
+        "bpm"},
+    { "tempo-step-bars", 0, 0, G_OPTION_ARG_INT,
+        &headless_options.tempo_step_bars,
+        "Measures between tempo steps, default 8", "n"},
+    { "tempo-ramp", 0, 0, G_OPTION_ARG_STRING, &headless_options.tempo_ramp,
+        "Change tempo in steps, or in a linear or exponential ramp",
+        "step|linear|exponential"},
+    { "beats", 0, 0, G_OPTION_ARG_INT, &headless_options.beats_per_measure,
+        "Beats per measure", "n"},
+    { "pattern", 0, 0, G_OPTION_ARG_STRING, &headless_options.pattern,
+        "Click pattern, e.g. \"7/8: X x x X x X x\"", "pattern"},
+    { "duration", 0, 0, G_OPTION_ARG_INT, &headless_options.duration,
+        "Seconds to run, default is until interrupted", "s"},
+    { "record", 0, 0, G_OPTION_ARG_FILENAME,
+        &headless_options.record_filename, "Write captured notes to file",
+        "file"},
+    { NULL }
 };
 
 int
 main (int argc, char *argv[])
 {
+    if (!g_thread_supported ())
+    {
+        g_thread_init (NULL);
+    }
+
     GError *error = NULL;
     GOptionContext *context;
     context = g_option_context_new ("- A graphical metronome for drummers");
     g_option_context_add_main_entries (context, option_entries, NULL);
-    g_option_context_add_group (context, gtk_get_option_group (TRUE));
-    g_option_context_add_group (context, clutter_get_option_group ());
+
+    GOptionGroup *headless_group = g_option_group_new ("headless",
+            "Headless Options:", "Show headless options", NULL, NULL);
+    g_option_group_add_entries (headless_group, headless_option_entries);
+    g_option_context_add_group (context, headless_group);
+
+    // Don't open a display until we know that we are not headless
+    g_option_context_add_group (context, gtk_get_option_group (FALSE));
+    g_option_context_add_group (context,
+            clutter_get_option_group_without_init ());
 
     if (!g_option_context_parse (context, &argc, &argv, &error))
     {
@@ -60,6 +128,44 @@ main (int argc, char *argv[])
     }
 
     drum_io_init (input_client, input_port, output_client, output_port);
+    drum_io_set_use_thread (io_thread);
+    drum_io_set_real_time_input (real_time_input);
+
+    if (ppq != 0)
+    {
+        if (ppq < 0)
+        {
+            g_print ("ppq must be positive\n");
+            exit (1);
+        }
+        drum_io_set_ppq (ppq);
+    }
+
+    if (audio_click_device != NULL &&
+            !drum_io_set_audio_click (audio_click_device, &error))
+    {
+        g_print ("could not open audio click device: %s\n", error->message);
+        exit (1);
+    }
+
+    if (kit_profile != NULL)
+    {
+        DrumMap *map = drum_map_load (kit_profile, &error);
+        if (map == NULL)
+        {
+            g_print ("could not load kit profile: %s\n", error->message);
+            exit (1);
+        }
+        drum_io_set_midi_to_drum_map (map);
+    }
+
+    if (headless)
+    {
+        return headless_run (&headless_options);
+    }
+
+    gtk_init (&argc, &argv);
+    clutter_init (&argc, &argv);
 
     GtkWidget *window = create_main_window ();
 
@@ -68,8 +174,15 @@ main (int argc, char *argv[])
 
     gtk_main();
 
+    if (frame_stats)
+    {
+        main_window_dump_frame_stats (stdout);
+    }
+
     delete_main_window();
 
+    latency_stats_dump (stdout);
+
     return EXIT_SUCCESS;
 }
 
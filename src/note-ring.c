@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "note-ring.h"
+
+struct NoteRing_
+{
+    DrumNote *notes;
+    guint mask;  // Capacity - 1, capacity is a power of two
+
+    // Free running counters, the slot is the counter masked. Head is only
+    // written by the producer and tail only by the consumer.
+    volatile gint head;
+    volatile gint tail;
+};
+
+/**
+ * Creates a ring that holds at least capacity notes.
+ */
+NoteRing *note_ring_new (guint capacity)
+{
+    guint size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    NoteRing *ring = g_malloc (sizeof (NoteRing));
+    ring->notes = g_malloc (sizeof (DrumNote) * size);
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return ring;
+}
+
+void note_ring_free (NoteRing *ring)
+{
+    g_free (ring->notes);
+    g_free (ring);
+}
+
+/**
+ * Copies a note into the ring. Returns FALSE if the ring is full. Must only
+ * be called by the producer.
+ */
+gboolean note_ring_push (NoteRing *ring, const DrumNote *note)
+{
+    guint head = ring->head;
+    guint tail = g_atomic_int_get (&ring->tail);
+
+    if (head - tail > ring->mask)
+    {
+        return FALSE;
+    }
+
+    ring->notes[head & ring->mask] = *note;
+
+    // Publish the note, the atomic set acts as a barrier for the copy above
+    g_atomic_int_set (&ring->head, head + 1);
+
+    return TRUE;
+}
+
+/**
+ * Copies up to max_notes of the oldest notes to notes and removes them from
+ * the ring. Returns the number of notes copied. Must only be called by the
+ * consumer.
+ */
+guint note_ring_pop (NoteRing *ring, DrumNote *notes, guint max_notes)
+{
+    guint tail = ring->tail;
+    guint head = g_atomic_int_get (&ring->head);
+
+    guint n_notes = MIN (head - tail, max_notes);
+    for (guint i = 0; i < n_notes; ++i)
+    {
+        notes[i] = ring->notes[(tail + i) & ring->mask];
+    }
+
+    g_atomic_int_set (&ring->tail, tail + n_notes);
+
+    return n_notes;
+}
+
+/**
+ * Removes all notes from the ring. Neither producer nor consumer may use the
+ * ring at the same time.
+ */
+void note_ring_clear (NoteRing *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NOTE_RING_H__
+#define __NOTE_RING_H__
+
+#include "drum-track.h"
+#include <glib.h>
+
+/*
+ * Fixed size single producer, single consumer queue of notes. One thread may
+ * push while another thread pops without any locking.
+ */
+typedef struct NoteRing_ NoteRing;
+
+NoteRing *note_ring_new (guint capacity);
+void note_ring_free (NoteRing *ring);
+
+gboolean note_ring_push (NoteRing *ring, const DrumNote *note);
+guint note_ring_pop (NoteRing *ring, DrumNote *notes, guint max_notes);
+void note_ring_clear (NoteRing *ring);
+
+#endif // __NOTE_RING_H__
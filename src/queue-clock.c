@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "queue-clock.h"
+
+#define MAX_CLOCK_ERROR 2000  // us, larger errors reset the clock
+#define MAX_RATE_ERROR 0.005  // Largest rate correction
+#define PLL_PHASE_GAIN 0.5  // Part of the error corrected by the next sync
+#define PLL_RATE_GAIN 0.05  // Part of the error corrected for good
+#define MAX_TEMPO_CHANGES 16  // Ahead of a sync, ramp steps can be ~50 ms
+
+typedef struct TempoChange_ TempoChange;
+
+struct TempoChange_
+{
+    gint64 usec;  // Queue us of the change
+    gdouble tick;
+    gdouble ticks_per_usec;
+};
+
+/*
+ * Queue position published to the readers. The queue time is extrapolated
+ * from base, then ticks from the tempo of base and through the tempo
+ * changes that follow it. The tempo map itself is only read by the syncing
+ * thread.
+ */
+typedef struct ClockState_ ClockState;
+
+struct ClockState_
+{
+    gint64 base_time;  // Monotonic us
+    gint64 base_usec;  // Queue us at base_time
+    gdouble rate;  // Queue us per monotonic us
+    gdouble base_tick;
+    gdouble ticks_per_usec;
+    TempoChange changes[MAX_TEMPO_CHANGES];  // The next ones, in order
+    guint n_changes;
+};
+
+struct QueueClock_
+{
+    // Odd while the state is written, readers retry until it stays even
+    volatile gint seq;
+    ClockState state;
+
+    // Only used by the syncing thread
+    gboolean synced;
+    gdouble rate;  // Queue us per monotonic us without phase correction
+};
+
+/**
+ * Creates a clock that is at tick 0 until the first sync.
+ */
+QueueClock *
+queue_clock_new (void)
+{
+    QueueClock *clock = g_malloc0 (sizeof (QueueClock));
+    queue_clock_reset (clock);
+
+    return clock;
+}
+
+void
+queue_clock_free (QueueClock *clock)
+{
+    g_free (clock);
+}
+
+static void
+begin_write (QueueClock *clock)
+{
+    g_atomic_int_inc (&clock->seq);
+}
+
+static void
+end_write (QueueClock *clock)
+{
+    g_atomic_int_inc (&clock->seq);
+}
+
+/*
+ * Sets the tempo part of state from tempo_map, at the base of state. Up to
+ * MAX_TEMPO_CHANGES changes after the base are taken, which covers the time
+ * until the next sync even during tempo ramps.
+ */
+static void
+set_tempo_state (ClockState *state, const TempoMap *tempo_map)
+{
+    unsigned int ppq = tempo_map_get_ppq (tempo_map);
+    gint64 usec = MAX (state->base_usec, 0);
+
+    state->base_tick = tempo_map_usec_to_fractional_tick (tempo_map, usec);
+    unsigned int tick = state->base_tick;
+    state->ticks_per_usec = (gdouble) ppq /
+        tempo_map_get_tempo (tempo_map, tick);
+
+    guint index = tempo_map_find_change (tempo_map, tick + 1);
+    unsigned int change_tick;
+    unsigned int change_tempo;
+
+    state->n_changes = 0;
+    while (state->n_changes < MAX_TEMPO_CHANGES &&
+            tempo_map_get_change (tempo_map, index + state->n_changes,
+                &change_tick, &change_tempo))
+    {
+        TempoChange *change = &state->changes[state->n_changes++];
+        change->usec = tempo_map_tick_to_usec (tempo_map, change_tick);
+        change->tick = change_tick;
+        change->ticks_per_usec = (gdouble) ppq / change_tempo;
+    }
+}
+
+/**
+ * Puts the clock back at tick 0 until the next sync. Must only be called by
+ * the syncing thread.
+ */
+void
+queue_clock_reset (QueueClock *clock)
+{
+    begin_write (clock);
+    clock->state.base_time = 0;
+    clock->state.base_usec = 0;
+    clock->state.rate = 0;
+    clock->state.base_tick = 0;
+    clock->state.ticks_per_usec = 0;
+    clock->state.n_changes = 0;
+    end_write (clock);
+
+    clock->synced = FALSE;
+    clock->rate = 1;
+}
+
+/**
+ * Syncs the clock with the queue, which was at queue_usec at monotonic time
+ * now. Small errors are corrected gradually, so that the ticks read keep
+ * increasing, larger ones reset the clock to the queue.
+ */
+void
+queue_clock_sync (QueueClock *clock, gint64 now, gint64 queue_usec,
+        const TempoMap *tempo_map)
+{
+    ClockState state = clock->state;
+
+    gint64 predicted = state.base_usec +
+        (gint64) ((now - state.base_time) * state.rate);
+    gint64 error = queue_usec - predicted;
+    gint64 interval = now - state.base_time;
+
+    if (!clock->synced || interval <= 0 || ABS (error) > MAX_CLOCK_ERROR)
+    {
+        clock->synced = TRUE;
+        clock->rate = 1;
+        state.base_usec = queue_usec;
+        state.rate = 1;
+    }
+    else
+    {
+        // Second order loop: the rate follows the error for good, the phase
+        // is pulled in by a temporary rate change until the next sync
+        clock->rate += PLL_RATE_GAIN * error / interval;
+        clock->rate = CLAMP (clock->rate, 1 - MAX_RATE_ERROR,
+                1 + MAX_RATE_ERROR);
+
+        state.base_usec = predicted;
+        state.rate = clock->rate + PLL_PHASE_GAIN * error / interval;
+        state.rate = CLAMP (state.rate, 1 - 2 * MAX_RATE_ERROR,
+                1 + 2 * MAX_RATE_ERROR);
+    }
+    state.base_time = now;
+    set_tempo_state (&state, tempo_map);
+
+    begin_write (clock);
+    clock->state = state;
+    end_write (clock);
+}
+
+/**
+ * Updates the clock after the tempo map changed. Must only be called by the
+ * syncing thread.
+ */
+void
+queue_clock_set_tempo_map (QueueClock *clock, const TempoMap *tempo_map)
+{
+    if (!clock->synced)
+    {
+        return;
+    }
+
+    ClockState state = clock->state;
+    set_tempo_state (&state, tempo_map);
+
+    begin_write (clock);
+    clock->state = state;
+    end_write (clock);
+}
+
+/**
+ * Returns the tick of the queue at monotonic time now. May be called from
+ * any thread.
+ */
+gdouble
+queue_clock_get_tick (QueueClock *clock, gint64 now)
+{
+    ClockState state;
+    gint seq;
+
+    do
+    {
+        seq = g_atomic_int_get (&clock->seq);
+        state = clock->state;
+    }
+    while ((seq & 1) != 0 || g_atomic_int_get (&clock->seq) != seq);
+
+    if (state.rate == 0)
+    {
+        return 0;
+    }
+
+    gdouble usec = state.base_usec + (now - state.base_time) * state.rate;
+
+    // Past a tempo change, continue from the last one passed
+    for (guint i = state.n_changes; i-- > 0;)
+    {
+        const TempoChange *change = &state.changes[i];
+        if (usec >= change->usec)
+        {
+            return change->tick +
+                (usec - change->usec) * change->ticks_per_usec;
+        }
+    }
+
+    return MAX (state.base_tick +
+            (usec - MAX (state.base_usec, 0)) * state.ticks_per_usec, 0);
+}
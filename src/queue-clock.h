@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUEUE_CLOCK_H__
+#define __QUEUE_CLOCK_H__
+
+#include "tempo-map.h"
+#include <glib.h>
+
+/*
+ * Extrapolates the position of a sequencer queue from the monotonic clock
+ * between occasional syncs with the queue. The queue time is followed with a
+ * small PLL and converted to ticks with the tempo map. One thread syncs the
+ * clock while other threads read ticks from it without any locking.
+ */
+typedef struct QueueClock_ QueueClock;
+
+QueueClock *queue_clock_new (void);
+void queue_clock_free (QueueClock *clock);
+
+void queue_clock_reset (QueueClock *clock);
+void queue_clock_sync (QueueClock *clock, gint64 now, gint64 queue_usec,
+        const TempoMap *tempo_map);
+void queue_clock_set_tempo_map (QueueClock *clock, const TempoMap *tempo_map);
+gdouble queue_clock_get_tick (QueueClock *clock, gint64 now);
+
+#endif // __QUEUE_CLOCK_H__
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tempo-map.h"
+
+#include <math.h>
+
+#define RAMP_STEPS_PER_BEAT 4  // Constant tempo steps that ramps are made of
+
+typedef struct TempoStep_ TempoStep;
+
+struct TempoStep_
+{
+    unsigned int tick;
+    gint64 usec;  // Time of tick from tick 0
+    unsigned int tempo;  // us per beat from tick
+};
+
+struct TempoMap_
+{
+    unsigned int ppq;
+    GArray *steps;  // Increasing tick, the first step is at tick 0
+};
+
+static inline unsigned int
+bpm_to_tempo (double bpm)
+{
+    g_assert (bpm > 0);
+
+    return 60.0e6 / bpm + 0.5;
+}
+
+static inline TempoStep *
+get_step (const TempoMap *map, guint index)
+{
+    return &g_array_index (map->steps, TempoStep, index);
+}
+
+/*
+ * Returns the index of the step that tick is in.
+ */
+static guint
+find_step (const TempoMap *map, unsigned int tick)
+{
+    guint low = 0;
+    guint high = map->steps->len;
+
+    while (high - low > 1)
+    {
+        guint middle = (low + high) / 2;
+        if (get_step (map, middle)->tick <= tick)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Returns the index of the step that usec is in.
+ */
+static guint
+find_step_by_usec (const TempoMap *map, gint64 usec)
+{
+    guint low = 0;
+    guint high = map->steps->len;
+
+    while (high - low > 1)
+    {
+        guint middle = (low + high) / 2;
+        if (get_step (map, middle)->usec <= usec)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Sets tempo from tick, removing any later steps.
+ */
+static void
+set_step (TempoMap *map, unsigned int tick, unsigned int tempo)
+{
+    guint index = find_step (map, tick);
+    TempoStep *last = get_step (map, index);
+
+    g_array_set_size (map->steps, index + 1);
+
+    if (last->tick == tick)
+    {
+        last->tempo = tempo;
+    }
+    else if (last->tempo != tempo)
+    {
+        TempoStep step = { tick: tick, usec: last->usec +
+            (gint64) (tick - last->tick) * last->tempo / map->ppq,
+            tempo: tempo };
+
+        g_array_append_val (map->steps, step);
+    }
+}
+
+/**
+ * Creates a tempo map with constant tempo. Ticks are ppq per beat.
+ */
+TempoMap *
+tempo_map_new (unsigned int ppq, double bpm)
+{
+    g_assert (ppq > 0);
+
+    TempoMap *map = g_malloc (sizeof (TempoMap));
+    map->ppq = ppq;
+    map->steps = g_array_new (FALSE, FALSE, sizeof (TempoStep));
+
+    TempoStep step = { tick: 0, usec: 0, tempo: bpm_to_tempo (bpm) };
+    g_array_append_val (map->steps, step);
+
+    return map;
+}
+
+TempoMap *
+tempo_map_copy (const TempoMap *map)
+{
+    TempoMap *copy = g_malloc (sizeof (TempoMap));
+    copy->ppq = map->ppq;
+    copy->steps = g_array_sized_new (FALSE, FALSE, sizeof (TempoStep),
+            map->steps->len);
+    g_array_append_vals (copy->steps, map->steps->data, map->steps->len);
+
+    return copy;
+}
+
+void
+tempo_map_free (TempoMap *map)
+{
+    g_array_free (map->steps, TRUE);
+    g_free (map);
+}
+
+/**
+ * Changes tempo at tick. Any tempo changes after tick are removed.
+ */
+void
+tempo_map_set_tempo (TempoMap *map, unsigned int tick, double bpm)
+{
+    set_step (map, tick, bpm_to_tempo (bpm));
+}
+
+/**
+ * Ramps tempo from the tempo at start_tick to end_bpm at end_tick, staying
+ * at end_bpm after that. Any tempo changes after start_tick are removed.
+ */
+void
+tempo_map_add_ramp (TempoMap *map, unsigned int start_tick,
+        unsigned int end_tick, double end_bpm, TempoRamp ramp)
+{
+    g_assert (end_tick > start_tick);
+
+    double start_bpm = 60.0e6 / tempo_map_get_tempo (map, start_tick);
+    unsigned int step_length = MAX (map->ppq / RAMP_STEPS_PER_BEAT, 1);
+    unsigned int n_steps = (end_tick - start_tick + step_length - 1) /
+        step_length;
+
+    for (unsigned int i = 0; i < n_steps; ++i)
+    {
+        // Tempo in the middle of the step
+        double position = (i + 0.5) / n_steps;
+        double bpm = start_bpm;
+
+        switch (ramp)
+        {
+            case TEMPO_RAMP_LINEAR:
+                bpm = start_bpm + (end_bpm - start_bpm) * position;
+                break;
+            case TEMPO_RAMP_EXPONENTIAL:
+                bpm = start_bpm * pow (end_bpm / start_bpm, position);
+                break;
+        }
+
+        set_step (map, start_tick + i * step_length, bpm_to_tempo (bpm));
+    }
+
+    set_step (map, end_tick, bpm_to_tempo (end_bpm));
+}
+
+/**
+ * Removes all tempo changes after tick.
+ */
+void
+tempo_map_truncate (TempoMap *map, unsigned int tick)
+{
+    g_array_set_size (map->steps, find_step (map, tick) + 1);
+}
+
+unsigned int
+tempo_map_get_ppq (const TempoMap *map)
+{
+    return map->ppq;
+}
+
+/**
+ * Returns the tempo at tick in us per beat.
+ */
+unsigned int
+tempo_map_get_tempo (const TempoMap *map, unsigned int tick)
+{
+    return get_step (map, find_step (map, tick))->tempo;
+}
+
+/**
+ * Returns the time of tick in us from tick 0.
+ */
+gint64
+tempo_map_tick_to_usec (const TempoMap *map, unsigned int tick)
+{
+    const TempoStep *step = get_step (map, find_step (map, tick));
+
+    return step->usec + (gint64) (tick - step->tick) * step->tempo / map->ppq;
+}
+
+/**
+ * Returns the last tick at or before usec from tick 0.
+ */
+unsigned int
+tempo_map_usec_to_tick (const TempoMap *map, gint64 usec)
+{
+    if (usec <= 0)
+    {
+        return 0;
+    }
+
+    const TempoStep *step = get_step (map, find_step_by_usec (map, usec));
+
+    return step->tick + (usec - step->usec) * map->ppq / step->tempo;
+}
+
+/**
+ * Returns the tick at usec from tick 0, including the part of the tick
+ * passed.
+ */
+double
+tempo_map_usec_to_fractional_tick (const TempoMap *map, gint64 usec)
+{
+    if (usec <= 0)
+    {
+        return 0;
+    }
+
+    const TempoStep *step = get_step (map, find_step_by_usec (map, usec));
+
+    return step->tick + (double) (usec - step->usec) * map->ppq / step->tempo;
+}
+
+/**
+ * Returns the index of the first tempo change at or after tick, for use with
+ * tempo_map_get_change().
+ */
+guint
+tempo_map_find_change (const TempoMap *map, unsigned int tick)
+{
+    guint index = find_step (map, tick);
+
+    if (get_step (map, index)->tick < tick)
+    {
+        index++;
+    }
+
+    return index;
+}
+
+/**
+ * Gets the tick and the new tempo, in us per beat, of tempo change index.
+ * Returns FALSE if there is no such change.
+ */
+gboolean
+tempo_map_get_change (const TempoMap *map, guint index,
+        unsigned int *tick, unsigned int *tempo)
+{
+    if (index >= map->steps->len)
+    {
+        return FALSE;
+    }
+
+    *tick = get_step (map, index)->tick;
+    *tempo = get_step (map, index)->tempo;
+
+    return TRUE;
+}
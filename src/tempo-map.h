@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TEMPO_MAP_H__
+#define __TEMPO_MAP_H__
+
+#include <glib.h>
+
+/*
+ * Tempo of a performance as a function of tick. Tempo changes and ramps are
+ * compiled into steps of constant tempo with precomputed start times, so
+ * conversions between ticks and time take O(log n) in the number of steps.
+ */
+typedef struct TempoMap_ TempoMap;
+
+typedef enum TempoRamp_ TempoRamp;
+
+enum TempoRamp_ { TEMPO_RAMP_LINEAR, TEMPO_RAMP_EXPONENTIAL };
+
+TempoMap *tempo_map_new (unsigned int ppq, double bpm);
+TempoMap *tempo_map_copy (const TempoMap *map);
+void tempo_map_free (TempoMap *map);
+
+void tempo_map_set_tempo (TempoMap *map, unsigned int tick, double bpm);
+void tempo_map_add_ramp (TempoMap *map, unsigned int start_tick,
+        unsigned int end_tick, double end_bpm, TempoRamp ramp);
+void tempo_map_truncate (TempoMap *map, unsigned int tick);
+
+unsigned int tempo_map_get_ppq (const TempoMap *map);
+unsigned int tempo_map_get_tempo (const TempoMap *map, unsigned int tick);
+gint64 tempo_map_tick_to_usec (const TempoMap *map, unsigned int tick);
+unsigned int tempo_map_usec_to_tick (const TempoMap *map, gint64 usec);
+double tempo_map_usec_to_fractional_tick (const TempoMap *map, gint64 usec);
+
+guint tempo_map_find_change (const TempoMap *map, unsigned int tick);
+gboolean tempo_map_get_change (const TempoMap *map, guint index,
+        unsigned int *tick, unsigned int *tempo);
+
+#endif // __TEMPO_MAP_H__
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Runs headless drumscope against the virtual drummer and reports input
+# throughput, lost notes and click jitter. Needs only the ALSA sequencer, no
+# MIDI hardware.
+#
+# Usage: tools/benchmark.sh [steps per second] [burst] [seconds]
+#
+# e.g. tools/benchmark.sh 1000 4 10 for a flood of 8000 notes per second.
+# TEMPO sets the click tempo, DRUMSCOPE_ARGS and DRUMMER_ARGS are passed on,
+# e.g. DRUMSCOPE_ARGS="--ppq=960 --real-time-input".
+
+set -e
+
+BUILD=${BUILD:-build/default}
+RATE=${1:-8}
+BURST=${2:-1}
+DURATION=${3:-10}
+TEMPO=${TEMPO:-120}
+
+OUT=$(mktemp -d)
+DRUMMER=
+trap '[ -n "$DRUMMER" ] && kill $DRUMMER 2>/dev/null; rm -rf "$OUT"' EXIT
+
+"$BUILD/tools/virtual-drummer" --rate="$RATE" --burst="$BURST" \
+    --duration="$DURATION" --tempo="$TEMPO" --record="$OUT/clicks.txt" \
+    $DRUMMER_ARGS > "$OUT/drummer.txt" &
+DRUMMER=$!
+
+# The first line has the ports of the drummer
+while ! grep -q '^virtual-drummer' "$OUT/drummer.txt"; do
+    kill -0 $DRUMMER
+    sleep 0.1
+done
+set -- $(head -n 1 "$OUT/drummer.txt")
+NOTES_PORT=$2
+CLICKS_PORT=$4
+
+# Runs until the drummer is surely done, it waits for drumscope to connect
+"$BUILD/src/drumscope" --headless --io-thread --tempo="$TEMPO" \
+    --duration=$((DURATION + 2)) \
+    --input-client="${NOTES_PORT%:*}" --input-port="${NOTES_PORT#*:}" \
+    --output-client="${CLICKS_PORT%:*}" --output-port="${CLICKS_PORT#*:}" \
+    --record="$OUT/notes.txt" $DRUMSCOPE_ARGS > "$OUT/drumscope.txt"
+wait $DRUMMER
+DRUMMER=
+
+echo "== Virtual drummer"
+tail -n +2 "$OUT/drummer.txt"
+echo
+echo "== Drumscope"
+cat "$OUT/drumscope.txt"
+echo
+
+SENT=$(awk '/^Notes sent/ { print $3 }' "$OUT/drummer.txt")
+RECEIVED=$(grep -vc '^#' "$OUT/notes.txt" || true)
+echo "== Ground truth"
+echo "Notes sent           $SENT"
+echo "Notes recorded       $RECEIVED"
+echo "Notes lost           $((SENT - RECEIVED))"
@@ -0,0 +1,504 @@
+/*
+ * Copyright (C) 2009 Nils Björklund
+ *
+ * This file is part of Drumscope.
+ *
+ * Drumscope is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Drumscope is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drumscope.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stand-in for a MIDI drumkit. Plays a groove script into drumscope's input
+ * port and records the clicks that drumscope plays back, so timing can be
+ * benchmarked without a physical kit.
+ *
+ * A groove script has one step per line with the notes played together, as
+ * note:velocity pairs, or '-' for a rest. Lines starting with '#' are
+ * comments. The script is repeated until the duration has passed.
+ */
+
+#include <glib.h>
+#include <alsa/asoundlib.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOOKAHEAD 100000  // us of notes to keep scheduled
+#define POLL_TIMEOUT 1  // ms
+#define OUTPUT_POOL_SIZE 4000  // Events the sequencer may hold for us
+#define MAX_NOTES_PER_STEP 16
+
+typedef struct Step_ Step;
+
+struct Step_
+{
+    int n_notes;
+    unsigned char notes[MAX_NOTES_PER_STEP];
+    unsigned char velocities[MAX_NOTES_PER_STEP];
+};
+
+// Kick and hihat, snare and hihat in eighths, notes of the default drum map
+static const char *DEFAULT_SCRIPT =
+    "36:100 42:80\n42:60\n38:110 42:80\n42:60\n";
+
+static gchar *script_filename = NULL;
+static gdouble rate = 8;
+static gint burst = 1;
+static gint jitter = 0;
+static gint seed = 0;
+static gint duration = 10;
+static gint start_delay = 500;
+static gint tempo = 0;
+static gchar *record_filename = NULL;
+
+static GOptionEntry option_entries[] =
+{
+    { "script", 0, 0, G_OPTION_ARG_FILENAME, &script_filename,
+        "Groove script to play, default is a rock beat in eighths", "file"},
+    { "rate", 0, 0, G_OPTION_ARG_DOUBLE, &rate,
+        "Steps per second, default 8", "n"},
+    { "burst", 0, 0, G_OPTION_ARG_INT, &burst,
+        "Play each note this many times per step, for note floods", "n"},
+    { "jitter", 0, 0, G_OPTION_ARG_INT, &jitter,
+        "Randomize step times and velocities, up to this many us early or "
+        "late, default is to play the script exactly", "us"},
+    { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+        "Seed of the randomization, for repeatable runs", "n"},
+    { "duration", 0, 0, G_OPTION_ARG_INT, &duration,
+        "Seconds to play, default 10", "s"},
+    { "start-delay", 0, 0, G_OPTION_ARG_INT, &start_delay,
+        "Milliseconds to wait after drumscope connected, default 500", "ms"},
+    { "tempo", 0, 0, G_OPTION_ARG_INT, &tempo,
+        "Tempo of the clicks, to measure their jitter against the beat grid",
+        "bpm"},
+    { "record", 0, 0, G_OPTION_ARG_FILENAME, &record_filename,
+        "Write the received clicks to file", "file"},
+    { NULL }
+};
+
+static snd_seq_t *seq = NULL;
+static int out_port_id = -1;
+static int in_port_id = -1;
+static int queue_id = -1;
+
+static guint n_notes_sent = 0;
+static guint n_send_retries = 0;
+static GArray *click_times = NULL;  // gint64 queue us of each click
+static GArray *click_notes = NULL;  // guint8 channel and note, 2 per click
+static GArray *click_velocities = NULL;  // guint8
+
+/*
+ * Parses a groove script. Returns the steps or NULL and sets error.
+ */
+static GArray *
+parse_script (const char *script, GError **error)
+{
+    GArray *steps = g_array_new (FALSE, FALSE, sizeof (Step));
+    gchar **lines = g_strsplit (script, "\n", -1);
+
+    for (int i = 0; lines[i] != NULL; ++i)
+    {
+        gchar *line = g_strstrip (lines[i]);
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+
+        Step step = { n_notes: 0 };
+        gchar **words = g_strsplit_set (line, " \t", -1);
+        for (int j = 0; words[j] != NULL; ++j)
+        {
+            int note;
+            int velocity;
+            if (words[j][0] == '\0' || strcmp (words[j], "-") == 0)
+            {
+                continue;
+            }
+
+            if (sscanf (words[j], "%d:%d", &note, &velocity) != 2 ||
+                    note < 0 || note > 127 || velocity < 1 ||
+                    velocity > 127 || step.n_notes == MAX_NOTES_PER_STEP)
+            {
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                        "invalid note %s on script line %d", words[j], i + 1);
+                g_strfreev (words);
+                g_strfreev (lines);
+                g_array_free (steps, TRUE);
+                return NULL;
+            }
+
+            step.notes[step.n_notes] = note;
+            step.velocities[step.n_notes] = velocity;
+            step.n_notes++;
+        }
+        g_strfreev (words);
+
+        g_array_append_val (steps, step);
+    }
+    g_strfreev (lines);
+
+    if (steps->len == 0)
+    {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                "script has no steps");
+        g_array_free (steps, TRUE);
+        return NULL;
+    }
+
+    return steps;
+}
+
+static gint64
+get_queue_time (void)
+{
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca (&status);
+    snd_seq_get_queue_status (seq, queue_id, status);
+
+    const snd_seq_real_time_t *time =
+        snd_seq_queue_status_get_real_time (status);
+
+    return (gint64) time->tv_sec * G_USEC_PER_SEC + time->tv_nsec / 1000;
+}
+
+static void
+init_seq (void)
+{
+    int err = snd_seq_open (&seq, "default", SND_SEQ_OPEN_DUPLEX,
+            SND_SEQ_NONBLOCK);
+    if (err < 0)
+    {
+        g_printerr ("could not open sequencer: %s\n", snd_strerror (err));
+        exit (1);
+    }
+
+    snd_seq_set_client_name (seq, "virtual-drummer");
+    snd_seq_set_client_pool_output (seq, OUTPUT_POOL_SIZE);
+    snd_seq_set_output_buffer_size (seq, OUTPUT_POOL_SIZE *
+            sizeof (snd_seq_event_t));
+
+    queue_id = snd_seq_alloc_queue (seq);
+    g_assert (queue_id >= 0);
+
+    out_port_id = snd_seq_create_simple_port (seq, "output",
+            SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+            SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    g_assert (out_port_id >= 0);
+
+    // Clicks are stamped with the real time of our queue on arrival
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca (&info);
+    snd_seq_port_info_set_name (info, "clicks");
+    snd_seq_port_info_set_capability (info,
+            SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+    snd_seq_port_info_set_type (info,
+            SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_port_info_set_timestamping (info, 1);
+    snd_seq_port_info_set_timestamp_real (info, 1);
+    snd_seq_port_info_set_timestamp_queue (info, queue_id);
+    err = snd_seq_create_port (seq, info);
+    g_assert (err >= 0);
+    in_port_id = snd_seq_port_info_get_port (info);
+
+    // Scripts read this to find us
+    printf ("virtual-drummer %d:%d clicks %d:%d\n", snd_seq_client_id (seq),
+            out_port_id, snd_seq_client_id (seq), in_port_id);
+    fflush (stdout);
+}
+
+/*
+ * Waits until someone subscribed to our output port.
+ */
+static void
+wait_for_subscriber (void)
+{
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca (&info);
+
+    for (;;)
+    {
+        snd_seq_get_port_info (seq, out_port_id, info);
+        if (snd_seq_port_info_get_read_use (info) > 0)
+        {
+            return;
+        }
+        g_usleep (10000);
+    }
+}
+
+static void
+read_clicks (void)
+{
+    snd_seq_event_t *ev;
+    while (snd_seq_event_input (seq, &ev) >= 0)
+    {
+        if (ev->type != SND_SEQ_EVENT_NOTEON || ev->data.note.velocity == 0)
+        {
+            continue;
+        }
+
+        gint64 usec = (gint64) ev->time.time.tv_sec * G_USEC_PER_SEC +
+            ev->time.time.tv_nsec / 1000;
+        guint8 note[2] = { ev->data.note.channel, ev->data.note.note };
+        guint8 velocity = ev->data.note.velocity;
+
+        g_array_append_val (click_times, usec);
+        g_array_append_vals (click_notes, note, 2);
+        g_array_append_val (click_velocities, velocity);
+    }
+}
+
+/*
+ * Puts a note on at usec of our queue in the output buffer. Returns FALSE if
+ * the sequencer is full.
+ */
+static gboolean
+put_note (gint64 usec, int note, int velocity)
+{
+    snd_seq_event_t ev;
+    snd_seq_ev_clear (&ev);
+
+    snd_seq_real_time_t time = { tv_sec: usec / G_USEC_PER_SEC,
+        tv_nsec: (usec % G_USEC_PER_SEC) * 1000 };
+
+    snd_seq_ev_set_source (&ev, out_port_id);
+    snd_seq_ev_set_subs (&ev);
+    snd_seq_ev_schedule_real (&ev, queue_id, 0, &time);
+    snd_seq_ev_set_noteon (&ev, 9, note, velocity);
+
+    return snd_seq_event_output (seq, &ev) >= 0;
+}
+
+/*
+ * Plays the steps until duration has passed, recording clicks meanwhile.
+ */
+static void
+play (GArray *steps)
+{
+    GRand *rand = g_rand_new_with_seed (seed);
+    gint64 step_length = G_USEC_PER_SEC / rate;
+    gint64 stop_time = (gint64) duration * G_USEC_PER_SEC;
+    gint64 next_time = 0;
+    guint n_step = 0;
+
+    int n_fds = snd_seq_poll_descriptors_count (seq, POLLIN);
+    struct pollfd *fds = g_new (struct pollfd, n_fds);
+    snd_seq_poll_descriptors (seq, fds, n_fds, POLLIN);
+
+    snd_seq_start_queue (seq, queue_id, NULL);
+    snd_seq_drain_output (seq);
+
+    // Notes of the current step sent before the sequencer got full
+    int n_pending = 0;
+
+    for (;;)
+    {
+        gint64 now = get_queue_time ();
+        if (now >= stop_time)
+        {
+            break;
+        }
+
+        gboolean full = FALSE;
+        while (!full && next_time < MIN (now + LOOKAHEAD, stop_time))
+        {
+            const Step *step = &g_array_index (steps, Step,
+                    n_step % steps->len);
+            gint64 time = next_time;
+            if (jitter > 0)
+            {
+                time += g_rand_int_range (rand, -jitter, jitter + 1);
+                time = MAX (time, 0);
+            }
+
+            int n_step_notes = step->n_notes * burst;
+            for (; n_pending < n_step_notes; ++n_pending)
+            {
+                int i = n_pending % step->n_notes;
+                int velocity = step->velocities[i];
+                if (jitter > 0)
+                {
+                    velocity = CLAMP (velocity +
+                            g_rand_int_range (rand, -10, 11), 1, 127);
+                }
+
+                if (!put_note (time, step->notes[i], velocity))
+                {
+                    n_send_retries++;
+                    full = TRUE;
+                    break;
+                }
+                n_notes_sent++;
+            }
+
+            if (!full)
+            {
+                n_pending = 0;
+                n_step++;
+                next_time = n_step * step_length;
+            }
+        }
+        snd_seq_drain_output (seq);
+
+        poll (fds, n_fds, POLL_TIMEOUT);
+        read_clicks ();
+    }
+
+    // Let the last clicks arrive
+    g_usleep (LOOKAHEAD);
+    read_clicks ();
+
+    snd_seq_stop_queue (seq, queue_id, NULL);
+    snd_seq_drain_output (seq);
+
+    g_free (fds);
+    g_rand_free (rand);
+}
+
+static void
+print_summary (void)
+{
+    double seconds = duration;
+
+    printf ("Notes sent           %u\n", n_notes_sent);
+    printf ("Notes per second     %.1f\n", n_notes_sent / seconds);
+    printf ("Send retries         %u\n", n_send_retries);
+    printf ("Clicks received      %u\n", click_times->len);
+
+    if (click_times->len < 2)
+    {
+        return;
+    }
+
+    // Intervals between clicks
+    double sum = 0;
+    double sum_squares = 0;
+    guint n = click_times->len - 1;
+    for (guint i = 0; i < n; ++i)
+    {
+        double interval = g_array_index (click_times, gint64, i + 1) -
+            g_array_index (click_times, gint64, i);
+        sum += interval;
+        sum_squares += interval * interval;
+    }
+    double mean = sum / n;
+    double stddev = sqrt (MAX (sum_squares / n - mean * mean, 0));
+    printf ("Click interval (us)  mean %.1f stddev %.1f\n", mean, stddev);
+
+    if (tempo <= 0)
+    {
+        return;
+    }
+
+    // Deviation from the beat grid starting at the first click
+    double beat = 60.0e6 / tempo;
+    gint64 first = g_array_index (click_times, gint64, 0);
+    double max_deviation = 0;
+    double deviation_squares = 0;
+    for (guint i = 0; i < click_times->len; ++i)
+    {
+        double offset = g_array_index (click_times, gint64, i) - first;
+        double deviation = offset - floor (offset / beat + 0.5) * beat;
+        max_deviation = MAX (max_deviation, fabs (deviation));
+        deviation_squares += deviation * deviation;
+    }
+    printf ("Click jitter (us)    rms %.1f max %.1f\n",
+            sqrt (deviation_squares / click_times->len), max_deviation);
+}
+
+static gboolean
+write_recording (const char *filename)
+{
+    FILE *file = fopen (filename, "w");
+    if (file == NULL)
+    {
+        return FALSE;
+    }
+
+    fprintf (file, "# time channel note velocity\n");
+    for (guint i = 0; i < click_times->len; ++i)
+    {
+        fprintf (file, "%lld %d %d %d\n",
+                (long long) g_array_index (click_times, gint64, i),
+                g_array_index (click_notes, guint8, 2 * i) + 1,
+                g_array_index (click_notes, guint8, 2 * i + 1),
+                g_array_index (click_velocities, guint8, i));
+    }
+
+    return fclose (file) == 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new (
+            "- A virtual drummer for drumscope benchmarks");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("option parsing failed: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    if (rate <= 0 || burst < 1 || jitter < 0 || duration <= 0)
+    {
+        g_printerr ("rate, burst and duration must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    gchar *script = NULL;
+    if (script_filename == NULL)
+    {
+        script = g_strdup (DEFAULT_SCRIPT);
+    }
+    else if (!g_file_get_contents (script_filename, &script, NULL, &error))
+    {
+        g_printerr ("could not read script: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    GArray *steps = parse_script (script, &error);
+    g_free (script);
+    if (steps == NULL)
+    {
+        g_printerr ("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    click_times = g_array_new (FALSE, FALSE, sizeof (gint64));
+    click_notes = g_array_new (FALSE, FALSE, sizeof (guint8));
+    click_velocities = g_array_new (FALSE, FALSE, sizeof (guint8));
+
+    init_seq ();
+    wait_for_subscriber ();
+    g_usleep (start_delay * 1000);
+
+    play (steps);
+    print_summary ();
+
+    int status = EXIT_SUCCESS;
+    if (record_filename != NULL && !write_recording (record_filename))
+    {
+        g_printerr ("could not write recording to %s\n", record_filename);
+        status = EXIT_FAILURE;
+    }
+
+    g_array_free (steps, TRUE);
+    snd_seq_close (seq);
+
+    return status;
+}